@@ -1,2 +1,2 @@
 #!/bin/sh
-g++ -DPRINT_USING_EXE -o print_using print_using.cpp
+g++ -DPRINT_USING_EXE -o print_using print_using.cpp -pthread
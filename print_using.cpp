@@ -74,23 +74,50 @@
 // *書式文字列*は、最初にあるルールに従っていくつかの「書式項目（format item）」と呼ばれる部分文字列に分割され、書式項目を単位として処理されます。書式項目の個数が*式*の個数よりも大きいときは、余った*式*は無視されます。書式項目の個数が*式*の個数よりも小さいときは最初の書式項目に戻って順番に循環します。その他のときは、書式項目と*式*は順番に1対1に対応します。
 /////////////////////////////////////////////////////////////////////////////
 
-#include <iostream>
+#ifdef PRINT_USING_TEST
+    #undef NDEBUG // テストではassertを有効にする
+#endif
+#include <cstddef>
+#include <cstdio>
 #include <cstdint>
 #include <cstdlib>
 #include <cstring>
 #include <cstdarg>
 #include <cmath>
 #include <cassert>
-#include <string>
-#include <vector>
-#include <memory>
+#include <cerrno>
 #include <limits>
 #include <algorithm>
+#ifndef PRINT_USING_MINIMAL
+    #include <string>
+    #include <vector>
+    #include <memory>
+    #include <type_traits>
+    #include <atomic>
+    #include <chrono>
+    #include <mutex>
+    #include <thread>
+    #ifdef _WIN32
+        #ifndef NOMINMAX
+            #define NOMINMAX
+        #endif
+        #include <windows.h>
+        #include <io.h>
+    #else
+        #include <fcntl.h>
+        #include <sys/mman.h>
+        #include <sys/stat.h>
+        #include <sys/uio.h>
+        #include <unistd.h>
+    #endif
+#endif
 #include "print_using.h"
 
 typedef float VskSingle;
 typedef double VskDouble;
+#ifndef PRINT_USING_MINIMAL
 typedef std::string VskString;
+#endif
 
 // PRINT USING文の書式の種類
 enum VskFormatType {
@@ -101,34 +128,259 @@ enum VskFormatType {
     UT_WHOLESTR,    // 文字列全部を出力： '@'
 };
 
-// PRINT USING文の書式データ
-struct VskFormatItem {
+// PRINT USING文の方言（通貨記号の種類）
+enum VskDialect {
+    VSK_DIALECT_YEN,                                // 円記号（'\\'）を使う
+    VSK_DIALECT_DOLLAR,                             // ドル記号（'$'）を使う
+#ifdef JAPAN
+    VSK_DIALECT_DEFAULT = VSK_DIALECT_YEN,          // 既定の方言
+#else
+    VSK_DIALECT_DEFAULT = VSK_DIALECT_DOLLAR,       // 既定の方言
+#endif
+};
+
+// 方言ポリシー：円記号
+struct VskDialectYen {
+    static const char currency = '\\';
+};
+
+// 方言ポリシー：ドル記号
+struct VskDialectDollar {
+    static const char currency = '$';
+};
+
+// 出力先。バッファーが一杯になるとm_flushが呼ばれる。
+// m_flushがなければ、あふれた分は捨てられる。
+// m_literalがあれば、書式項目の前後のテキストはコピーせずにm_literalに渡される
+struct VskWriter {
+    char *          m_buf;                          // バッファー
+    size_t          m_size;                         // バッファーのサイズ
+    size_t          m_len = 0;                      // 書き込んだ長さ
+    void          (*m_flush)(VskWriter& writer);    // バッファーを空ける関数
+    void          (*m_literal)(VskWriter& writer, const char *str, size_t len) = nullptr; // テキストを参照する関数
+
+    VskWriter(char *buf, size_t size, void (*flush)(VskWriter&) = nullptr)
+        : m_buf(buf), m_size(size), m_flush(flush) { }
+
+    bool flush() {
+        if (m_flush) m_flush(*this);
+        return m_len < m_size;
+    }
+    void put(char ch) {
+        if (m_len < m_size || flush())
+            m_buf[m_len++] = ch;
+    }
+    void put(const char *str, size_t len) {
+        while (len > 0 && (m_len < m_size || flush())) {
+            size_t count = std::min(len, m_size - m_len);
+            std::memcpy(&m_buf[m_len], str, count);
+            m_len += count;
+            str += count;
+            len -= count;
+        }
+    }
+#ifndef PRINT_USING_MINIMAL
+    void put(const VskString& str) {
+        put(str.data(), str.size());
+    }
+#endif
+    // 出力が終わるまで変更されないテキストを出力する
+    void put_literal(const char *str, size_t len) {
+        if (m_literal)
+            m_literal(*this, str, len);
+        else
+            put(str, len);
+    }
+    void fill(char ch, size_t len) {
+        while (len > 0 && (m_len < m_size || flush())) {
+            size_t count = std::min(len, m_size - m_len);
+            std::memset(&m_buf[m_len], ch, count);
+            m_len += count;
+            len -= count;
+        }
+    }
+};
+
+#ifndef PRINT_USING_MINIMAL
+// 文字列への出力先
+struct VskStringWriter : VskWriter {
+    VskString&      m_str;                          // 出力する文字列
+    char            m_chunk[256];                   // 作業用バッファー
+
+    explicit VskStringWriter(VskString& str) : VskWriter(m_chunk, sizeof(m_chunk), flush_string), m_str(str) { }
+    ~VskStringWriter() { flush(); }
+
+    static void flush_string(VskWriter& writer) {
+        auto& self = static_cast<VskStringWriter&>(writer);
+        self.m_str.append(self.m_buf, self.m_len);
+        self.m_len = 0;
+    }
+};
+#endif
+
+// ファイルへの出力先
+struct VskFileWriter : VskWriter {
+    FILE *          m_fp;                           // 出力するファイル
+    size_t          m_total = 0;                    // 出力した長さ
+    char            m_chunk[4096];                  // 作業用バッファー
+
+    explicit VskFileWriter(FILE *fp) : VskWriter(m_chunk, sizeof(m_chunk), flush_file), m_fp(fp) { }
+    ~VskFileWriter() { flush(); }
+
+    static void flush_file(VskWriter& writer) {
+        auto& self = static_cast<VskFileWriter&>(writer);
+        std::fwrite(self.m_buf, 1, self.m_len, self.m_fp);
+        self.m_total += self.m_len;
+        self.m_len = 0;
+    }
+};
+
+// コールバック関数への出力先
+struct VskSinkWriter : VskWriter {
+    PRINT_USING_SINK    m_sink;                     // 出力する関数
+    void *              m_context;                  // 関数に渡すデータ
+    char                m_chunk[256];               // 作業用バッファー
+
+    VskSinkWriter(PRINT_USING_SINK sink, void *context)
+        : VskWriter(m_chunk, sizeof(m_chunk), flush_sink), m_sink(sink), m_context(context) { }
+    ~VskSinkWriter() { flush(); }
+
+    static void flush_sink(VskWriter& writer) {
+        auto& self = static_cast<VskSinkWriter&>(writer);
+        if (self.m_len)
+            self.m_sink(self.m_context, self.m_buf, self.m_len);
+        self.m_len = 0;
+    }
+};
+
+// 書式項目ごとの整形処理（カーネル）の種類
+enum VskKernel {
+    VSK_KERNEL_UNKNOWN,     // 前後のテキストのみ
+    VSK_KERNEL_INTEGER,     // "###"
+    VSK_KERNEL_FIXED,       // "###.##"
+    VSK_KERNEL_COMMA,       // "#,###.##"
+    VSK_KERNEL_FILL,        // "**###.##", "\\###.##", "**\###.##"
+    VSK_KERNEL_SCIENTIFIC,  // "##.##^^^^"
+    VSK_KERNEL_GENERIC,     // その他の数値書式（"+###", "###-"など）
+    VSK_KERNEL_FIRSTCHAR,   // "!"
+    VSK_KERNEL_PARTIALSTR,  // "&  &"
+    VSK_KERNEL_WHOLESTR,    // "@"
+    VSK_KERNEL_MAX
+};
+
+// PRINT USING文の書式項目の仕様（文字列を持たない）
+struct VskFormatSpec {
     VskFormatType   m_type = UT_UNKNOWN;            // 書式の種類
-    VskString       m_pre;                          // 前に付くテキスト
-    VskString       m_text;                         // 実体のテキスト
-    VskString       m_post;                         // 後に付くテキスト
     int             m_width = 0;                    // 幅
     int             m_precision = 0;                // 精度
     bool            m_dot = false;                  // ドット（"."）があるか？
     bool            m_asterisk = false;             // "*"か？
-#ifdef JAPAN
-    bool            m_yen = false;                  // "\\"か？
-#else
-    bool            m_dollar = false;               // "$"か？
-#endif
+    char            m_currency = 0;                 // 通貨記号（'\\'か'$'）。なければ0
     bool            m_comma = false;                // ","か？
     bool            m_scientific = false;           // 指数表示（"^^^^"）か？
     bool            m_pre_plus = false;             // 前に付く"+"か？
     bool            m_post_plus = false;            // 後ろに付く"+"か？
     bool            m_post_minus = false;           // 後ろに付く"-"か？
-    size_t next_format(const VskString& str, size_t ib0, size_t& ib1);
-    size_t parse_string(const VskString& str, size_t ib);
-    size_t parse_numeric(const VskString& str, size_t ib);
+    VskKernel       m_kernel = VSK_KERNEL_UNKNOWN;  // 整形処理の種類
+};
+
+// 書式項目を分類して、カーネルを選ぶ
+static VskKernel vsk_select_kernel(const VskFormatSpec& spec)
+{
+    switch (spec.m_type) {
+    case UT_NUMERIC:
+        if (spec.m_scientific)
+            return VSK_KERNEL_SCIENTIFIC;
+        if (spec.m_pre_plus || spec.m_post_plus || spec.m_post_minus)
+            return VSK_KERNEL_GENERIC;
+        if (spec.m_asterisk || spec.m_currency)
+            return VSK_KERNEL_FILL;
+        if (spec.m_comma)
+            return VSK_KERNEL_COMMA;
+        if (spec.m_dot)
+            return VSK_KERNEL_FIXED;
+        return VSK_KERNEL_INTEGER;
+    case UT_FIRSTCHAR:
+        return VSK_KERNEL_FIRSTCHAR;
+    case UT_PARTIALSTR:
+        return VSK_KERNEL_PARTIALSTR;
+    case UT_WHOLESTR:
+        return VSK_KERNEL_WHOLESTR;
+    default:
+        return VSK_KERNEL_UNKNOWN;
+    }
+}
+
+// 前後のテキストを評価して出力する（"_"の次の文字はそのまま出力する）
+static void vsk_write_literal(VskWriter& writer, const char *s, size_t len)
+{
+    const char *end = s + len;
+    while (s < end) {
+        const char *underscore = static_cast<const char *>(std::memchr(s, '_', end - s));
+        if (!underscore) {
+            writer.put(s, end - s);
+            break;
+        }
+        writer.put(s, underscore - s);
+        s = underscore + 1;
+        if (s < end) {
+            writer.put(*s++);
+        } else {
+            writer.put('_');
+        }
+    }
+}
+
+#ifndef PRINT_USING_MINIMAL
+// PRINT USING文の書式データ
+struct VskFormatMemo;
+
+// 数値書式の結果のメモへのポインタ。コピーしてもメモは共有せず、空のメモを新しく作る
+struct VskFormatMemoPtr {
+    VskFormatMemo * m_ptr = nullptr;                // メモ
+
+    VskFormatMemoPtr() { }
+    VskFormatMemoPtr(const VskFormatMemoPtr& other);
+    VskFormatMemoPtr(VskFormatMemoPtr&& other) noexcept : m_ptr(other.m_ptr) { other.m_ptr = nullptr; }
+    VskFormatMemoPtr& operator=(const VskFormatMemoPtr& other);
+    VskFormatMemoPtr& operator=(VskFormatMemoPtr&& other) noexcept;
+    ~VskFormatMemoPtr() { reset(); }
+    void reset(VskFormatMemo *ptr = nullptr);
+    VskFormatMemo *operator->() const { return m_ptr; }
+    explicit operator bool() const { return m_ptr != nullptr; }
+};
+
+struct VskFormatItem : VskFormatSpec {
+    VskString       m_pre;                          // 前に付くテキスト
+    VskString       m_text;                         // 実体のテキスト
+    VskString       m_post;                         // 後に付くテキスト
+    VskString       m_pre_literal;                  // 評価済みの前に付くテキスト
+    VskString       m_post_literal;                 // 評価済みの後に付くテキスト
+    VskFormatMemoPtr m_memo;                        // 数値書式の結果のメモ（コピーとは共有しない）
     VskString format_string(VskString s) const;
     VskString format_numeric(VskDouble d, bool is_double = false) const;
+    void write_string(VskWriter& writer, const char *s, size_t len) const;
+    void write_numeric(VskWriter& writer, VskDouble d, bool is_double = false) const;
+    void write_numeric_memo(VskWriter& writer, VskDouble d, bool is_double = false);
+    void compile();
+    bool enable_memo(bool enable = true);
     void clear() { *this = VskFormatItem(); }
 };
 
+// 配列が伸びるときに書式項目をコピーせずにムーブできるか？
+static_assert(std::is_nothrow_move_constructible<VskFormatItem>::value, "VskFormatItem must be nothrow movable");
+
+// 前後のテキストを評価する
+VskString vsk_format_pre_post(VskString s)
+{
+    VskString out;
+    {
+        VskStringWriter writer(out);
+        vsk_write_literal(writer, s.data(), s.size());
+    }
+    return out;
+}
+
 // 数値文字列にカンマ区切りを追加
 VskString vsk_add_commas(const VskString& digits) {
     VskString out;
@@ -142,8 +394,9 @@ VskString vsk_add_commas(const VskString& digits) {
     }
     return out;
 }
+#endif  // ndef PRINT_USING_MINIMAL
 
-#ifndef NDEBUG
+#ifdef PRINT_USING_TEST
 // vsk_add_commas関数のテスト
 void vsk_add_commas_test() {
     assert(vsk_add_commas("0") == "0");
@@ -155,234 +408,201 @@ void vsk_add_commas_test() {
 }
 #endif
 
-// 文字書式をパースする
-size_t VskFormatItem::parse_string(const VskString& str, size_t ib) {
-    switch (str[ib]) {
-    case '&':
-        ++ib;
-        while (str[ib] == ' ') ++ib;
-        if (str[ib] == '&') {
-            ++ib;
-        }
-        break;
-    case '@':
-    case '!':
-        ++ib;
-    default:
-        break;
+// 書式の字句。書式文字列の中の位置と書式項目の仕様を持つ
+struct VskFormatToken : VskFormatSpec {
+    size_t          m_pre_pos = 0;                  // 前に付くテキストの位置
+    size_t          m_text_pos = 0;                 // 実体のテキストの位置
+    size_t          m_post_pos = 0;                 // 後に付くテキストの位置
+    size_t          m_end_pos = 0;                  // 書式項目の終わりの位置
+};
+
+// 書式文字列を字句に分けるもの。
+// 文字列を1回だけ走査し（後戻りは高々2文字）、範囲外を読まず、メモリーを確保しない
+template <typename T_DIALECT>
+struct VskFormatTokenizer {
+    const char *    m_str;                          // 書式文字列
+    size_t          m_len;                          // 書式文字列の長さ
+    size_t          m_pos = 0;                      // 次の字句の位置
+
+    VskFormatTokenizer(const char *str, size_t len) : m_str(str), m_len(len) { }
+
+    // 範囲外なら0を返す
+    char at(size_t ib) const {
+        return (ib < m_len) ? m_str[ib] : 0;
     }
-    return ib;
-}
+    bool next(VskFormatToken& token);
+    size_t parse_numeric(VskFormatSpec& spec, size_t ib) const;
+};
 
 // 数値書式をパースする
-size_t VskFormatItem::parse_numeric(const VskString& str, size_t ib) {
-    clear();
-    m_type = UT_NUMERIC;
-    if (str[ib] == '+') {
-        m_pre_plus = true;
-        ++m_width;
+template <typename T_DIALECT>
+size_t VskFormatTokenizer<T_DIALECT>::parse_numeric(VskFormatSpec& spec, size_t ib) const
+{
+    const char currency = T_DIALECT::currency;
+    spec = VskFormatSpec();
+    spec.m_type = UT_NUMERIC;
+    if (at(ib) == '+') {
+        spec.m_pre_plus = true;
+        ++spec.m_width;
         ++ib;
     }
-#ifdef JAPAN
-    if (std::memcmp(&str[ib], "**\\", 3) == 0) {
-        m_asterisk = m_yen = true;
-        m_width += 3;
-        ib += 3;
-#else
-    if (std::memcmp(&str[ib], "**$", 3) == 0) {
-        m_asterisk = m_dollar = true;
-        m_width += 3;
+    if (at(ib) == '*' && at(ib + 1) == '*' && at(ib + 2) == currency) {
+        spec.m_asterisk = true;
+        spec.m_currency = currency;
+        spec.m_width += 3;
         ib += 3;
-#endif
-    } else if (std::memcmp(&str[ib], "**", 2) == 0) {
-        m_asterisk = true;
-        m_width += 2;
-        ib += 2;
-#ifdef JAPAN
-    } else if (std::memcmp(&str[ib], "\\\\", 2) == 0) {
-        m_yen = true;
-        m_width += 2;
+    } else if (at(ib) == '*' && at(ib + 1) == '*') {
+        spec.m_asterisk = true;
+        spec.m_width += 2;
         ib += 2;
-#else
-    } else if (std::memcmp(&str[ib], "$$", 2) == 0) {
-        m_dollar = true;
-        m_width += 2;
+    } else if (at(ib) == currency && at(ib + 1) == currency) {
+        spec.m_currency = currency;
+        spec.m_width += 2;
         ib += 2;
-#endif
     }
-    while (str[ib] == ',' || str[ib] == '#') {
-        if (str[ib] == ',') m_comma = true;
-        ++m_width;
+    while (at(ib) == ',' || at(ib) == '#') {
+        if (at(ib) == ',') spec.m_comma = true;
+        ++spec.m_width;
         ++ib;
     }
-    if (str[ib] == '.') { m_dot = true; ++m_width; ++ib; }
-    if (m_dot) {
-        while (str[ib] == '#') { ++ib; ++m_width; ++m_precision; }
+    if (at(ib) == '.') { spec.m_dot = true; ++spec.m_width; ++ib; }
+    if (spec.m_dot) {
+        while (at(ib) == '#') { ++ib; ++spec.m_width; ++spec.m_precision; }
     }
-    if (std::memcmp(&str[ib], "^^^^", 4) == 0) {
-        m_scientific = true;
+    if (at(ib) == '^' && at(ib + 1) == '^' && at(ib + 2) == '^' && at(ib + 3) == '^') {
+        spec.m_scientific = true;
         ib += 4;
     }
-    if (!m_pre_plus) {
-        if (str[ib] == '-') {
-            m_post_minus = true;
+    if (!spec.m_pre_plus) {
+        if (at(ib) == '-') {
+            spec.m_post_minus = true;
             ++ib;
-        } else if (str[ib] == '+') {
-            m_post_plus = true;
+        } else if (at(ib) == '+') {
+            spec.m_post_plus = true;
             ++ib;
         }
     }
     return ib;
 }
 
-// 次の書式
-size_t VskFormatItem::next_format(const VskString& str, size_t ib0, size_t& ib1) {
-    size_t ib = ib0, ib_save;
-    m_type = UT_UNKNOWN;
-    bool found = false;
+// 次の字句を取得する。書式文字列の終わりならfalseを返す
+template <typename T_DIALECT>
+bool VskFormatTokenizer<T_DIALECT>::next(VskFormatToken& token)
+{
+    const char currency = T_DIALECT::currency;
+    const size_t ib0 = m_pos;
+    if (ib0 >= m_len)
+        return false;
 
+    token = VskFormatToken();
+    token.m_pre_pos = ib0;
+    bool found = false;
+    size_t ib = ib0;
     for (;;) {
-        if (str.size() <= ib) {
-            if (!found) {
-                ib1 = str.size();
-                return ib;
-            }
-            return str.size();
+        if (ib >= m_len) {
+            if (!found)
+                token.m_text_pos = token.m_post_pos = m_len;
+            break;
         }
-        switch (str[ib]) {
+
+        // 数値書式の始まりなら、直前の"."や"+"を含める。
+        // ただし、前の書式項目の実体には戻らない
+        const size_t lower = (found ? token.m_post_pos : ib0);
+        size_t ib_start;
+        const char ch = m_str[ib];
+        switch (ch) {
         case '_':
-            if (ib + 1 < str.size()) {
-                ib += 2;
-                continue;
-            }
-            ++ib;
+            ib += (ib + 1 < m_len) ? 2 : 1;
             continue;
         case '!':
-            if (found) return ib;
-            ib1 = ib;
+        case '@':
+            if (found)
+                break;
             found = true;
-            m_type = UT_FIRSTCHAR;
-            ib1 = ib;
-            ++ib;
+            token.m_type = (ch == '!') ? UT_FIRSTCHAR : UT_WHOLESTR;
+            token.m_width = (ch == '!') ? 1 : 0;
+            token.m_text_pos = ib++;
+            token.m_post_pos = ib;
             continue;
         case '&':
-            ib_save = ib;
-            ++ib;
-            while (str[ib] == ' ') ++ib;
-            if (str[ib] != '&') {
+            ib_start = ib++;
+            while (at(ib) == ' ') ++ib;
+            if (at(ib) != '&')
                 continue;
-            }
-            ++ib;
-            if (found) return ib_save;
-            ib1 = ib_save;
-            found = true;
-            m_type = UT_PARTIALSTR;
-            continue;
-        case '@':
-            if (found) return ib;
-            ib1 = ib;
-            found = true;
             ++ib;
-            m_type = UT_WHOLESTR;
-            continue;
-        case '#':
-            if (ib0 < ib && str[ib - 1] == '.') {
-                --ib;
+            if (found) {
+                ib = ib_start;
+                break;
             }
-            if (ib0 < ib && str[ib - 1] == '+') {
-                --ib;
-            }
-            if (found) return ib;
-            ib1 = ib;
             found = true;
-            clear();
-            ib = parse_numeric(str, ib);
+            token.m_type = UT_PARTIALSTR;
+            token.m_width = int(ib - ib_start);
+            token.m_text_pos = ib_start;
+            token.m_post_pos = ib;
             continue;
-#ifdef JAPAN
-        case '\\':
-            if (std::memcmp(&str[ib], "\\\\", 2) != 0)
-#else
-        case '$':
-            if (std::memcmp(&str[ib], "$$", 2) != 0)
-#endif
-            {
-                ++ib;
-                continue;
-            }
-            if (ib0 < ib && str[ib - 1] == '+') {
-                --ib;
-            }
-            if (found) return ib;
-            ib1 = ib;
+        case '#':
+            if (lower < ib && m_str[ib - 1] == '.') --ib;
+            if (lower < ib && m_str[ib - 1] == '+') --ib;
+            if (found)
+                break;
             found = true;
-            clear();
-            ib = parse_numeric(str, ib);
+            token.m_text_pos = ib;
+            ib = token.m_post_pos = parse_numeric(token, ib);
             continue;
-        case '*':
-#ifdef JAPAN
-            if (std::memcmp(&str[ib], "**\\", 3) == 0)
-#else
-            if (std::memcmp(&str[ib], "**$", 3) == 0)
-#endif
-            {
-                if (ib0 < ib && str[ib - 1] == '+') {
-                    --ib;
-                }
-                if (found) return ib;
-                ib1 = ib;
-                found = true;
-                clear();
-                ib = parse_numeric(str, ib);
-                continue;
-            }
-            if (std::memcmp(&str[ib], "**", 2) == 0) {
-                if (ib0 < ib && str[ib - 1] == '+') {
-                    --ib;
-                }
-                if (found) return ib;
-                ib1 = ib;
+        default:
+            // "**", "**\\", "\\\\"（通貨記号が2つ）
+            if ((ch == '*' && at(ib + 1) == '*') || (ch == currency && at(ib + 1) == currency)) {
+                if (lower < ib && m_str[ib - 1] == '+') --ib;
+                if (found)
+                    break;
                 found = true;
-                clear();
-                ib = parse_numeric(str, ib);
+                token.m_text_pos = ib;
+                ib = token.m_post_pos = parse_numeric(token, ib);
                 continue;
             }
             ++ib;
             continue;
-        default:
-            ++ib;
-            continue;
         }
+        break; // 次の書式項目が見つかった
     }
+
+    token.m_kernel = vsk_select_kernel(token);
+    token.m_end_pos = m_pos = std::min(ib, m_len);
+    return true;
 }
 
+#ifndef PRINT_USING_MINIMAL
 // PRINT USING文の書式を解析する
+template <typename T_DIALECT>
 bool vsk_parse_formats(std::vector<VskFormatItem>& items, const VskString& str)
 {
     items.clear();
 
-    size_t ib0 = 0, ib1, ib2, ib3;
-    while (ib0 < str.size()) {
+    VskFormatTokenizer<T_DIALECT> tokenizer(str.data(), str.size());
+    VskFormatToken token;
+    while (tokenizer.next(token)) {
         VskFormatItem item;
-        ib2 = item.next_format(str, ib0, ib1);
-        if (ib0 == ib2)
-            break;
-        if (item.m_type == UT_NUMERIC) {
-            ib3 = item.parse_numeric(str, ib1);
-        } else {
-            ib3 = item.parse_string(str, ib1);
-        }
-        item.m_pre = str.substr(ib0, ib1 - ib0);
-        item.m_text = str.substr(ib1, ib3 - ib1);
-        item.m_post = str.substr(ib3, ib2 - ib3);
-        //printf("'%s' '%s' '%s'\n", item.m_pre.c_str(), item.m_text.c_str(), item.m_post.c_str());
-        items.push_back(item);
-        ib0 = ib2;
+        static_cast<VskFormatSpec&>(item) = token;
+        item.m_pre.assign(str, token.m_pre_pos, token.m_text_pos - token.m_pre_pos);
+        item.m_text.assign(str, token.m_text_pos, token.m_post_pos - token.m_text_pos);
+        item.m_post.assign(str, token.m_post_pos, token.m_end_pos - token.m_post_pos);
+        item.compile();
+        items.push_back(std::move(item));
     }
 
     return !items.empty();
 }
 
-#ifndef NDEBUG
+// PRINT USING文の書式を解析する（方言を実行時に選ぶ）
+bool vsk_parse_formats(std::vector<VskFormatItem>& items, const VskString& str,
+                       VskDialect dialect = VSK_DIALECT_DEFAULT)
+{
+    if (dialect == VSK_DIALECT_YEN)
+        return vsk_parse_formats<VskDialectYen>(items, str);
+    return vsk_parse_formats<VskDialectDollar>(items, str);
+}
+
+#ifdef PRINT_USING_TEST
 // vsk_parse_formats関数のテスト
 void vsk_parse_formats_test(void)
 {
@@ -417,8 +637,27 @@ void vsk_parse_formats_test(void)
     assert(items[2].m_pre == "");
     assert(items[2].m_text == "###");
     assert(items[2].m_post == "");
+
+    // 後ろに付く"+"は次の書式項目に含めない
+    out = vsk_parse_formats(items, "##+##");
+    assert(out);
+    assert(items.size() == 2);
+    assert(items[0].m_text == "##+");
+    assert(items[0].m_post_plus);
+    assert(items[0].m_post == "");
+    assert(items[1].m_text == "##");
+
+    // 末尾で範囲外を読まない
+    out = vsk_parse_formats(items, "**", VSK_DIALECT_YEN);
+    assert(out && items.size() == 1 && items[0].m_width == 2);
+    out = vsk_parse_formats(items, "#.#^^^", VSK_DIALECT_YEN);
+    assert(out && items.size() == 1 && !items[0].m_scientific && items[0].m_post == "^^^");
+    out = vsk_parse_formats(items, "@&  ");
+    assert(out && items.size() == 1 && items[0].m_post == "&  ");
+    out = vsk_parse_formats(items, "!_");
+    assert(out && items.size() == 1 && items[0].m_post == "_");
 }
-#endif  // ndef NDEBUG
+#endif  // def PRINT_USING_TEST
 
 struct VskAst;
 typedef std::shared_ptr<VskAst> VskAstPtr;  // ASTへのポインタ
@@ -474,70 +713,98 @@ bool vsk_dbl(VskDouble& dbl, VskAstPtr arg)
     assert(0);
     return false;
 }
+#endif  // ndef PRINT_USING_MINIMAL
 
-// 文字列書式を評価する
-VskString vsk_format_pre_post(VskString s)
+// 10の累乗（正確に表せる範囲）
+static const VskDouble s_vsk_pow10[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+// 符号なし整数を10進数にして、bufの末尾から前に向かって書き込む。
+// commaが真ならば3桁ごとにカンマを入れる。書き込んだ先頭を返す
+static char *vsk_utoa_backward(char *end, unsigned long long value, bool comma)
 {
-    VskString out;
-    for (size_t ib = 0; ib < s.size(); ++ib) {
-        if (s[ib] == '_') {
-            if (ib + 1 < s.size()) {
-                out += s[++ib];
-            } else {
-                out += '_';
+    char *p = end;
+    int count = 0;
+    do {
+        if (comma && count && count % 3 == 0)
+            *--p = ',';
+        *--p = char('0' + value % 10);
+        value /= 10;
+        ++count;
+    } while (value);
+    return p;
+}
+
+// 小数部fracを精度precisionの桁数に丸め、数字をdecimalsに格納する。
+// 繰り上がったらtrueを返す。結果はstd::sprintf("%.*f")と同じ
+static bool vsk_round_fraction(VskDouble frac, int precision, char *decimals)
+{
+    assert(0 <= frac && frac < 1);
+    if (precision <= 9) {
+        // 丸めの境界から十分に離れていれば、乗算の誤差は結果に影響しない
+        VskDouble x = frac * s_vsk_pow10[precision];
+        VskDouble f = std::floor(x);
+        VskDouble rem = x - f;
+        if (std::fabs(rem - 0.5) > 1e-6) {
+            unsigned long long value = (unsigned long long)f + (rem > 0.5);
+            if (value >= (unsigned long long)s_vsk_pow10[precision])
+                return true;
+            if (precision > 0) {
+                char *p = vsk_utoa_backward(decimals + precision, value, false);
+                std::memset(decimals, '0', p - decimals);
             }
-            continue;
+            return false;
         }
-        out += s[ib];
     }
-    return out;
+
+    char buf[256];
+    std::sprintf(buf, "%.*f", precision, frac);
+    if (buf[0] == '1')
+        return true;
+    if (precision > 0)
+        std::memcpy(decimals, &buf[2], precision);
+    return false;
 }
 
-// 文字列書式を評価する
-VskString VskFormatItem::format_string(VskString s) const
+// 無効な数値 (NaN; Not a Number)や無限大（INFINITY）なら、それだけを出力してtrueを返す。
+// このとき前後のテキストは出力しない
+static bool vsk_write_nonfinite(VskWriter& writer, VskDouble d)
 {
-    assert(m_type != UT_NUMERIC);
-
-    VskString out = vsk_format_pre_post(m_pre);
-
-    if (m_text[0] == '@') {
-        out += s;
-    } else if (m_text[0] == '!') {
-        out += s[0];
-    } else if (m_text[0] == '&') {
-        s.resize(m_text.size(), ' ');
-        out += s;
+    if (std::isnan(d)) {
+        writer.put("NaN", 3);
+        return true;
     }
-
-    out += vsk_format_pre_post(m_post);
-    return out;
+    if (std::isinf(d)) {
+        writer.put(std::signbit(d) ? "-INF" : " INF", 4);
+        return true;
+    }
+    return false;
 }
 
-// 数値書式を評価する
-VskString VskFormatItem::format_numeric(VskDouble d, bool is_double) const
+// 数値書式のカーネル。欄だけを出力し、前後のテキストは呼び出し側が出力する。
+// テンプレート引数が偽の機能は使わない書式項目専用で、その分岐はコンパイル時に取り除かれる
+template <bool T_DOT, bool T_COMMA, bool T_FILL, bool T_SCIENTIFIC, bool T_SIGN>
+static void vsk_numeric_kernel(const VskFormatSpec& item, VskWriter& writer, VskDouble d, bool is_double)
 {
-    assert(m_type == UT_NUMERIC);
-
-    // 無効な数値 (NaN; Not a Number)か？
-    if (std::isnan(d)) return "NaN";
+    assert(std::isfinite(d));
 
     // マイナスがあれば覚えておき、絶対値にする
     bool minus = std::signbit(d);
     if (minus) d = -d;
 
-    // 無限大（INFINITY）か？
-    if (std::isinf(d)) return minus ? "-INF" : " INF";
-
     // 指数表示の指数を取得し、指数に合わせる
+    const bool scientific = T_SCIENTIFIC && item.m_scientific;
     int exponent = 0;
-    if (m_scientific) {
+    if (scientific) {
         if (d <= std::numeric_limits<decltype(d)>::epsilon()) {
             d = 0;
         } else {
             exponent = int(std::floor(std::log10(d)));
             d *= std::pow(10, -exponent);
 
-            auto delta = m_width - m_precision - m_dot - 2;
+            auto delta = item.m_width - item.m_precision - item.m_dot - 2;
             if (delta > 0) {
                 do
                 {
@@ -557,210 +824,1937 @@ VskString VskFormatItem::format_numeric(VskDouble d, bool is_double) const
     }
 
     // 小数部が長すぎないようにする（標準関数でオーバーフローを避けるため）
-    int precision = m_precision;
+    const bool dot = T_DOT && item.m_dot;
+    int precision = T_DOT ? item.m_precision : 0;
     if (precision > 256 - 2) precision = 256 - 2;
 
-    // 小数部をテキストに
-    char buf[256];
-    std::sprintf(buf, "%.*f", precision, d - std::floor(d));
-    if (std::strcmp(buf, "0") == 0)
-        std::strcpy(buf, "0.0");
-    if (buf[0] == '1') { // 四捨五入で繰り上がり？
-        auto str0 = std::to_string((unsigned long long)d);
-        d += 1;
-        auto str1 = std::to_string((unsigned long long)d);
-        if (str0.size() < str1.size() && m_scientific) {
-            ++exponent;
-            d /= 10;
+    // 小数部を丸める
+    char decimals[256];
+    const bool carry = vsk_round_fraction(d - std::floor(d), precision, decimals);
+    if (carry) { // 四捨五入で繰り上がり？
+        if (scientific) {
+            char buf0[24], buf1[24];
+            auto len0 = buf0 + 24 - vsk_utoa_backward(buf0 + 24, (unsigned long long)d, false);
+            d += 1;
+            auto len1 = buf1 + 24 - vsk_utoa_backward(buf1 + 24, (unsigned long long)d, false);
+            if (len0 < len1) {
+                ++exponent;
+                d /= 10;
+            }
+        } else {
+            d += 1;
         }
-        std::strcpy(buf, "0.0");
     }
-    assert(buf[0] == '0' && buf[1] == '.');
-    VskString decimals = &buf[1];
 
-    // 整数部をテキストに
-    VskString digits = std::to_string((unsigned long long)d);
-
-    // 必要ならカンマ(,)を追加
-    if (!m_scientific && m_comma) digits = vsk_add_commas(digits);
+    // 整数部をテキストに。必要ならカンマ(,)を追加
+    char digits_buf[48];
+    char *const digits_end = digits_buf + sizeof(digits_buf);
+    char *digits = vsk_utoa_backward(digits_end, (unsigned long long)d,
+                                     T_COMMA && !scientific && item.m_comma);
 
     // 通貨記号を追加
-#ifdef JAPAN
-    if (m_yen) digits = '\\' + digits;
-#else
-    if (m_dollar) digits = '$' + digits;
-#endif
+    if (T_FILL && item.m_currency) *--digits = item.m_currency;
 
     // 符号を追加
-    if (m_pre_plus) {
-        digits = (minus ? "-" : "+") + digits;
-    } else if (!m_post_plus && !m_post_minus) {
-        if (minus) {
-            digits = "-" + digits;
-        }
+    if (T_SIGN && item.m_pre_plus) {
+        *--digits = (minus ? '-' : '+');
+    } else if (!(T_SIGN && (item.m_post_plus || item.m_post_minus))) {
+        if (minus) *--digits = '-';
     }
-
-    VskString out; // 結果文字列
+    int len = int(digits_end - digits);
 
     // 必要ならば "0"を削る
-    int pre_dot = m_width - precision - m_dot;
+    int pre_dot = item.m_width - precision - dot;
     if (pre_dot <= 1) {
-        if (digits == "-0") digits = "-";
+        if (len == 2 && digits[0] == '-' && digits[1] == '0') len = 1;
     }
     if (pre_dot == 0) {
-        if (digits == "0") digits = "";
+        if (len == 1 && digits[0] == '0') len = 0;
     }
 
-    auto diff = m_width - precision - m_dot - int(digits.size());
+    auto diff = pre_dot - len;
     if (diff < 0) { // 桁が足りなければ "%"を出力
-        out = "%" + digits;
+        writer.put('%');
     } else if (diff > 0) { // 余裕があれば文字で埋める
-        if (m_asterisk) {
-            out += VskString(diff, '*') + digits;
-        } else {
-            out += VskString(diff, ' ') + digits;
-        }
-    } else { // その他の場合はそのまま
-        out = digits;
+        writer.fill((T_FILL && item.m_asterisk) ? '*' : ' ', diff);
     }
+    writer.put(digits, len);
 
-    if (m_dot) { // 小数点があるなら、小数点と小数部を追加
+    if (dot) { // 小数点があるなら、小数点と小数部を追加
+        writer.put('.');
         if (precision > 0) {
-            out += decimals;
-        } else {
-            out += '.';
+            if (carry)
+                writer.put('0');
+            else
+                writer.put(decimals, precision);
         }
     }
 
-    if (m_scientific) { // 指数表示なら、指数表示を追加
+    if (scientific) { // 指数表示なら、指数表示を追加
+        writer.put(is_double ? 'D' : 'E');
+        writer.put(exponent < 0 ? '-' : '+');
         char buf[16];
-        char ch = (is_double ? 'D' : 'E');
-        if (exponent < 0) {
-            std::sprintf(buf, "%c-%02u", ch, -exponent);
-        } else {
-            std::sprintf(buf, "%c+%02u", ch, exponent);
-        }
-        out += buf;
+        char *p = vsk_utoa_backward(buf + sizeof(buf), unsigned(exponent < 0 ? -exponent : exponent), false);
+        if (buf + sizeof(buf) - p < 2) *--p = '0';
+        writer.put(p, buf + sizeof(buf) - p);
     }
 
     // 末尾に符号を追加
-    if (m_post_plus) {
-        out += minus ? '-' : '+';
-    } else if (m_post_minus) {
-        out += minus ? '-' : ' ';
+    if (T_SIGN && item.m_post_plus) {
+        writer.put(minus ? '-' : '+');
+    } else if (T_SIGN && item.m_post_minus) {
+        writer.put(minus ? '-' : ' ');
     }
-
-    // 前後に文字列を追加
-    return vsk_format_pre_post(m_pre) + out + vsk_format_pre_post(m_post);
 }
 
-// PRINT USING文をエミュレートする
-bool vsk_print_using(VskString& out, const VskString& format_text, const VskAstList& args)
+// 文字書式のカーネル：前後のテキストのみ
+static void vsk_unknown_kernel(const VskFormatSpec&, VskWriter&, const char *, size_t)
 {
-    out.clear();
-
-    std::vector<VskFormatItem> items;
-    if (!vsk_parse_formats(items, format_text)) {
-        assert(0);
-        return false; // Failure
-    }
-
-    for (size_t iarg = 0; iarg < args.size(); ++iarg) {
-        auto& item = items[iarg % items.size()];
-        if (item.m_type == UT_UNKNOWN) {
-            out += item.format_string("");
-        } else if (item.m_type == UT_NUMERIC) {
-            VskDouble d;
-            if (!vsk_dbl(d, args[iarg]))
-                return false; // Failure
-            out += item.format_numeric(d, (args[iarg]->m_type == TYPE_DOUBLE));
-        } else {
-            VskString str;
-            if (!vsk_str(str, args[iarg]))
-                return false; // Failure
-            out += item.format_string(str);
-        }
-    }
-
-    return true; // Success
 }
 
-static VskString vstr_print_using(const char *format, va_list va)
+// 文字書式のカーネル："!"
+static void vsk_firstchar_kernel(const VskFormatSpec&, VskWriter& writer, const char *s, size_t len)
 {
-    std::vector<VskFormatItem> items;
-    if (!vsk_parse_formats(items, format) || items.empty()) {
-        fprintf(stderr, "Illegal function call\n");
-        return ""; // Failure
-    }
-
-    VskString out;
-    for (size_t iItem = 0; iItem < items.size(); ++iItem) {
-        auto& item = items[iItem];
-        if (item.m_type == UT_UNKNOWN) {
-            out += item.format_string("");
-        } else if (item.m_type == UT_NUMERIC) {
-            VskDouble d = va_arg(va, VskDouble);
-            out += item.format_numeric(d, true);
-        } else {
-            VskString str = va_arg(va, const char *);
-            out += item.format_string(str);
-        }
-    }
-
-    return out;
+    writer.put(len ? s[0] : '\0');
 }
 
-extern "C"
-void vsprint_using(char *buffer, size_t buffer_size, const char *format, va_list va)
+// 文字書式のカーネル："&  &"
+static void vsk_partialstr_kernel(const VskFormatSpec& item, VskWriter& writer, const char *s, size_t len)
 {
-    VskString out = vstr_print_using(format, va);
-    std::strncpy(buffer, out.c_str(), buffer_size);
-    if (buffer_size > 0)
-        buffer[buffer_size - 1] = 0;
+    const size_t width = item.m_width;
+    if (len > width) len = width;
+    writer.put(s, len);
+    writer.fill(' ', width - len);
 }
 
-extern "C"
-void sprint_using(char *buffer, size_t buffer_size, const char *format, ...)
+// 文字書式のカーネル："@"
+static void vsk_wholestr_kernel(const VskFormatSpec&, VskWriter& writer, const char *s, size_t len)
 {
-    va_list va;
-    va_start(va, format);
-    vsprint_using(buffer, buffer_size, format, va);
-    va_end(va);
+    writer.put(s, len);
 }
 
-extern "C"
-int vprint_using(const char *format, va_list va)
+typedef void (*VskNumericKernel)(const VskFormatSpec& item, VskWriter& writer, VskDouble d, bool is_double);
+typedef void (*VskStringKernel)(const VskFormatSpec& item, VskWriter& writer, const char *s, size_t len);
+
+// カーネルの表
+struct VskKernelEntry {
+    const char *        m_name;                     // 名前
+    VskNumericKernel    m_numeric;                  // 数値書式のカーネル
+    VskStringKernel     m_string;                   // 文字書式のカーネル
+};
+static const VskKernelEntry s_vsk_kernels[VSK_KERNEL_MAX] = {
+    { "unknown",    nullptr, vsk_unknown_kernel },
+    { "integer",    vsk_numeric_kernel<false, false, false, false, false>, nullptr },
+    { "fixed",      vsk_numeric_kernel<true, false, false, false, false>, nullptr },
+    { "comma",      vsk_numeric_kernel<true, true, false, false, false>, nullptr },
+    { "fill",       vsk_numeric_kernel<true, true, true, false, false>, nullptr },
+    { "scientific", vsk_numeric_kernel<true, false, true, true, true>, nullptr },
+    { "generic",    vsk_numeric_kernel<true, true, true, true, true>, nullptr },
+    { "firstchar",  nullptr, vsk_firstchar_kernel },
+    { "partialstr", nullptr, vsk_partialstr_kernel },
+    { "wholestr",   nullptr, vsk_wholestr_kernel },
+};
+
+#ifndef PRINT_USING_MINIMAL
+// 解析済みの書式項目を整形できるようにする
+void VskFormatItem::compile()
 {
-    VskString out = vstr_print_using(format, va);
-    return std::printf("%s\n", out.c_str());
+    m_pre_literal = vsk_format_pre_post(m_pre);
+    m_post_literal = vsk_format_pre_post(m_post);
+    m_kernel = vsk_select_kernel(*this);
 }
 
-extern "C"
-int print_using(const char *format, ...)
-{
-    va_list va;
+// 数値書式の結果のメモ。値のビット列と倍精度かどうかをキーとする、大きさが固定の
+// オープンアドレス法のハッシュ表で、整形済みの欄を覚えておく。ヒット率が低いあいだは迂回する。
+// スレッドセーフではない
+struct VskFormatMemo {
+    static const int        s_slot_bits = 8;        // スロットの数のビット数
+    static const size_t     s_num_slots = size_t(1) << s_slot_bits; // スロットの数
+    static const size_t     s_max_probe = 4;        // 探すスロットの最大数
+    static const size_t     s_max_text = 30;        // 覚えておける欄の最大の長さ
+    static const uint32_t   s_window = 4096;        // ヒット率を測る検索の回数
+    static const uint32_t   s_min_hits = 1024;      // 迂回しない検索あたりの最小ヒット数（25%）
+    static const uint32_t   s_bypass = 65536;       // 一度に迂回する回数
+
+    struct Slot {
+        uint64_t    m_key;                          // 値のビット列
+        bool        m_used;                         // 使用中か？
+        bool        m_is_double;                    // 倍精度か？
+        uint8_t     m_len;                          // 欄の長さ
+        char        m_text[s_max_text];             // 整形済みの欄
+    };
+    Slot            m_slots[s_num_slots];           // スロット
+    uint64_t        m_hits = 0;                     // ヒットした回数
+    uint64_t        m_misses = 0;                   // ヒットしなかった回数
+    uint64_t        m_bypassed = 0;                 // 迂回した回数
+    uint32_t        m_window_lookups = 0;           // 今回の測定の検索回数
+    uint32_t        m_window_hits = 0;              // 今回の測定のヒット数
+    uint32_t        m_bypass_left = 0;              // 残りの迂回する回数
+
+    VskFormatMemo() { clear(); }
+
+    void clear() {
+        for (auto& slot : m_slots)
+            slot.m_used = false;
+    }
+
+    static uint64_t key_of(VskDouble d) {
+        uint64_t key;
+        std::memcpy(&key, &d, sizeof(key));
+        return key;
+    }
+    static size_t hash_of(uint64_t key, bool is_double) {
+        // 積の上位ビットは全ビットの影響を受ける
+        return size_t(((key ^ is_double) * 0x9E3779B97F4A7C15ULL) >> (64 - s_slot_bits));
+    }
+
+    // メモを使うならtrueを返す。迂回が終わったら表を空にしてヒット率を測り直す
+    bool active() {
+        if (m_bypass_left == 0)
+            return true;
+        ++m_bypassed;
+        if (--m_bypass_left == 0)
+            clear();
+        return false;
+    }
+
+    // 覚えている欄を探す。なければnullptrを返す
+    const Slot *find(VskDouble d, bool is_double) {
+        const uint64_t key = key_of(d);
+        const size_t hash = hash_of(key, is_double);
+        const Slot *found = nullptr;
+        for (size_t i = 0; i < s_max_probe; ++i) {
+            const Slot& slot = m_slots[(hash + i) & (s_num_slots - 1)];
+            if (!slot.m_used)
+                break;
+            if (slot.m_key == key && slot.m_is_double == is_double) {
+                found = &slot;
+                break;
+            }
+        }
+
+        if (found) {
+            ++m_hits;
+            ++m_window_hits;
+        } else {
+            ++m_misses;
+        }
+        if (++m_window_lookups == s_window) {
+            if (m_window_hits < s_min_hits)
+                m_bypass_left = s_bypass;
+            m_window_lookups = m_window_hits = 0;
+        }
+        return found;
+    }
+
+    // 欄を覚える。空きがなければ最初のスロットを上書きする
+    void insert(VskDouble d, bool is_double, const char *text, size_t len) {
+        assert(len <= s_max_text);
+        const uint64_t key = key_of(d);
+        const size_t hash = hash_of(key, is_double);
+        Slot *target = &m_slots[hash];
+        for (size_t i = 0; i < s_max_probe; ++i) {
+            Slot& slot = m_slots[(hash + i) & (s_num_slots - 1)];
+            if (!slot.m_used) {
+                target = &slot;
+                break;
+            }
+        }
+        target->m_key = key;
+        target->m_used = true;
+        target->m_is_double = is_double;
+        target->m_len = uint8_t(len);
+        std::memcpy(target->m_text, text, len);
+    }
+
+    // ヒット率
+    double hit_rate() const {
+        return (m_hits + m_misses) ? double(m_hits) / double(m_hits + m_misses) : 0;
+    }
+};
+
+VskFormatMemoPtr::VskFormatMemoPtr(const VskFormatMemoPtr& other)
+    : m_ptr(other.m_ptr ? new VskFormatMemo() : nullptr)
+{
+}
+
+VskFormatMemoPtr& VskFormatMemoPtr::operator=(const VskFormatMemoPtr& other)
+{
+    if (this != &other)
+        reset(other.m_ptr ? new VskFormatMemo() : nullptr);
+    return *this;
+}
+
+VskFormatMemoPtr& VskFormatMemoPtr::operator=(VskFormatMemoPtr&& other) noexcept
+{
+    if (this != &other) {
+        reset(other.m_ptr);
+        other.m_ptr = nullptr;
+    }
+    return *this;
+}
+
+void VskFormatMemoPtr::reset(VskFormatMemo *ptr)
+{
+    delete m_ptr;
+    m_ptr = ptr;
+}
+
+// 数値書式の結果のメモを使うかどうか。欄が長すぎて覚えられないときはfalseを返す
+bool VskFormatItem::enable_memo(bool enable)
+{
+    m_memo.reset();
+    if (!enable)
+        return true;
+    // 欄の長さは高々、幅と符号と"%"と指数部
+    if (m_type != UT_NUMERIC || m_width + 7 > int(VskFormatMemo::s_max_text))
+        return false;
+    m_memo.reset(new VskFormatMemo());
+    return true;
+}
+
+// 文字列書式を評価する
+void VskFormatItem::write_string(VskWriter& writer, const char *s, size_t len) const
+{
+    assert(m_type != UT_NUMERIC);
+    writer.put_literal(m_pre_literal.data(), m_pre_literal.size());
+    s_vsk_kernels[m_kernel].m_string(*this, writer, s, len);
+    writer.put_literal(m_post_literal.data(), m_post_literal.size());
+}
+
+// 数値書式を評価する
+void VskFormatItem::write_numeric(VskWriter& writer, VskDouble d, bool is_double) const
+{
+    assert(m_type == UT_NUMERIC);
+    if (vsk_write_nonfinite(writer, d))
+        return;
+    writer.put_literal(m_pre_literal.data(), m_pre_literal.size());
+    s_vsk_kernels[m_kernel].m_numeric(*this, writer, d, is_double);
+    writer.put_literal(m_post_literal.data(), m_post_literal.size());
+}
+
+// 数値書式を評価する。メモがあればメモを使って更新する
+void VskFormatItem::write_numeric_memo(VskWriter& writer, VskDouble d, bool is_double)
+{
+    if (!m_memo) {
+        write_numeric(writer, d, is_double);
+        return;
+    }
+    assert(m_type == UT_NUMERIC);
+    if (vsk_write_nonfinite(writer, d))
+        return;
+    writer.put_literal(m_pre_literal.data(), m_pre_literal.size());
+    if (!m_memo->active()) {
+        s_vsk_kernels[m_kernel].m_numeric(*this, writer, d, is_double);
+    } else if (auto slot = m_memo->find(d, is_double)) {
+        writer.put(slot->m_text, slot->m_len);
+    } else {
+        // 欄を作業用バッファーに出力して覚える
+        char buf[VskFormatMemo::s_max_text + 1];
+        VskWriter field(buf, sizeof(buf));
+        s_vsk_kernels[m_kernel].m_numeric(*this, field, d, is_double);
+        if (field.m_len <= VskFormatMemo::s_max_text) {
+            m_memo->insert(d, is_double, buf, field.m_len);
+            writer.put(buf, field.m_len);
+        } else {
+            s_vsk_kernels[m_kernel].m_numeric(*this, writer, d, is_double);
+        }
+    }
+    writer.put_literal(m_post_literal.data(), m_post_literal.size());
+}
+
+// 文字列書式を評価する
+VskString VskFormatItem::format_string(VskString s) const
+{
+    VskString out;
+    {
+        VskStringWriter writer(out);
+        write_string(writer, s.data(), s.size());
+    }
+    return out;
+}
+
+// 数値書式を評価する
+VskString VskFormatItem::format_numeric(VskDouble d, bool is_double) const
+{
+    VskString out;
+    {
+        VskStringWriter writer(out);
+        write_numeric(writer, d, is_double);
+    }
+    return out;
+}
+
+// 解析済みの書式項目でPRINT USING文をエミュレートする
+bool vsk_print_using(VskWriter& writer, const std::vector<VskFormatItem>& items, const VskAstList& args)
+{
+    assert(!items.empty());
+    for (size_t iarg = 0; iarg < args.size(); ++iarg) {
+        auto& item = items[iarg % items.size()];
+        if (item.m_type == UT_UNKNOWN) {
+            item.write_string(writer, "", 0);
+        } else if (item.m_type == UT_NUMERIC) {
+            VskDouble d;
+            if (!vsk_dbl(d, args[iarg]))
+                return false; // Failure
+            item.write_numeric(writer, d, (args[iarg]->m_type == TYPE_DOUBLE));
+        } else {
+            VskString str;
+            if (!vsk_str(str, args[iarg]))
+                return false; // Failure
+            item.write_string(writer, str.data(), str.size());
+        }
+    }
+
+    return true; // Success
+}
+
+// PRINT USING文をエミュレートする
+bool vsk_print_using(VskString& out, const VskString& format_text, const VskAstList& args,
+                     VskDialect dialect = VSK_DIALECT_DEFAULT)
+{
+    out.clear();
+
+    std::vector<VskFormatItem> items;
+    if (!vsk_parse_formats(items, format_text, dialect)) {
+        assert(0);
+        return false; // Failure
+    }
+
+    VskStringWriter writer(out);
+    return vsk_print_using(writer, items, args);
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// PRINT USING文の出力を読み取る（逆変換）
+
+// 読み取った欄
+struct VskScanField {
+    VskFormatType   m_type = UT_UNKNOWN;            // 書式の種類
+    const char *    m_str = nullptr;                // 欄のテキスト（行の中を指す）
+    size_t          m_len = 0;                      // 欄のテキストの長さ
+    VskDouble       m_dbl = 0;                      // 数値
+    int64_t         m_int = 0;                      // 整数値（m_is_intのとき）
+    bool            m_is_int = false;               // 整数として表せるか？
+    bool            m_is_double = false;            // 指数が"D"か？
+    bool            m_overflow = false;             // 桁あふれ（"%"）があったか？
+};
+
+// PRINT USING文の出力を読み取るもの
+struct VskScanner {
+    std::vector<VskFormatItem>  m_items;            // 書式項目
+    bool compile(const VskString& format, VskDialect dialect = VSK_DIALECT_DEFAULT);
+    bool scan_line(const char *line, size_t len, VskScanField *fields, size_t max_fields, size_t& count) const;
+    template <typename T_STORE>
+    bool scan_fields(const char *line, size_t len, size_t max_fields, size_t& count, T_STORE store) const;
+};
+
+// 書式をコンパイルする
+bool VskScanner::compile(const VskString& format, VskDialect dialect)
+{
+    return vsk_parse_formats(m_items, format, dialect);
+}
+
+// 仮数と10の指数から倍精度実数を作る
+static VskDouble vsk_scan_make_double(uint64_t mantissa, int exp10)
+{
+    // 仮数も10の累乗も正確に表せるなら、1回の乗除算で正しく丸められる
+    if (mantissa < (uint64_t(1) << 53) && -22 <= exp10 && exp10 <= 22) {
+        if (exp10 < 0)
+            return VskDouble(mantissa) / s_vsk_pow10[-exp10];
+        return VskDouble(mantissa) * s_vsk_pow10[exp10];
+    }
+    char buf[64];
+    std::snprintf(buf, sizeof(buf), "%llue%d", (unsigned long long)mantissa, exp10);
+    return std::strtod(buf, nullptr);
+}
+
+// 数値の欄を読み取る。失敗したらnullptrを返す
+static const char *
+vsk_scan_numeric(const VskFormatItem& item, const char *p, const char *end, VskScanField& field)
+{
+    int precision = item.m_precision;
+    if (precision > 256 - 2) precision = 256 - 2;
+
+    // 桁あふれなら整数部の幅は不定
+    const char *int_end = end;
+    if (p < end && *p == '%') {
+        field.m_overflow = true;
+        ++p;
+    } else {
+        const int int_width = item.m_width - precision - item.m_dot;
+        if (end - p < int_width)
+            return nullptr;
+        int_end = p + int_width;
+        while (p < int_end && (*p == ' ' || *p == '*')) ++p;
+    }
+
+    // 符号と通貨記号
+    bool minus = false;
+    if (p < int_end && (*p == '-' || *p == '+')) {
+        minus = (*p == '-');
+        ++p;
+    }
+    if (item.m_currency && p < int_end && *p == item.m_currency)
+        ++p;
+
+    // 整数部。整数値は倍精度実数とは別に、あふれを確かめながら求める
+    const uint64_t limit = 1000000000000000000ULL; // 10^18
+    uint64_t mantissa = 0;
+    int exp10 = 0;
+    uint64_t int_value = 0;
+    bool is_int = true;
+    for (; p < int_end; ++p) {
+        if (*p == ',' && item.m_comma)
+            continue;
+        if (*p < '0' || '9' < *p)
+            break;
+        const unsigned digit = unsigned(*p - '0');
+        if (mantissa < limit)
+            mantissa = mantissa * 10 + digit;
+        else
+            ++exp10;
+        if (int_value > (UINT64_MAX - digit) / 10)
+            is_int = false;
+        else
+            int_value = int_value * 10 + digit;
+    }
+    if (!field.m_overflow && p != int_end)
+        return nullptr;
+
+    // 小数部
+    if (item.m_dot) {
+        if (p >= end || *p != '.')
+            return nullptr;
+        ++p;
+        // 四捨五入で繰り上がると小数部が短くなることがある
+        for (int i = 0; i < precision && p < end && '0' <= *p && *p <= '9'; ++i, ++p) {
+            if (*p != '0')
+                is_int = false;
+            if (mantissa < limit) {
+                mantissa = mantissa * 10 + (*p - '0');
+                --exp10;
+            }
+        }
+    }
+
+    // 指数部
+    if (item.m_scientific) {
+        if (p >= end || (*p != 'E' && *p != 'D'))
+            return nullptr;
+        field.m_is_double = (*p == 'D');
+        ++p;
+        if (p >= end || (*p != '+' && *p != '-'))
+            return nullptr;
+        bool exp_minus = (*p == '-');
+        ++p;
+        if (p >= end || *p < '0' || '9' < *p)
+            return nullptr;
+        int exponent = 0;
+        for (; p < end && '0' <= *p && *p <= '9'; ++p) {
+            if (exponent < 10000)
+                exponent = exponent * 10 + (*p - '0');
+        }
+        exp10 += (exp_minus ? -exponent : exponent);
+        is_int = false;
+    }
+
+    // 末尾の符号
+    if (item.m_post_plus || item.m_post_minus) {
+        if (p >= end)
+            return nullptr;
+        if (*p == '-')
+            minus = true;
+        else if (*p != '+' && *p != ' ')
+            return nullptr;
+        ++p;
+    }
+
+    VskDouble d = vsk_scan_make_double(mantissa, exp10);
+    field.m_dbl = (minus ? -d : d);
+
+    // 小数部も指数部もなく、int64_tに収まるときだけ整数とする
+    const uint64_t int_max = uint64_t(INT64_MAX);
+    if (is_int && int_value <= int_max + minus) {
+        field.m_is_int = true;
+        field.m_int = (minus ? -int64_t(int_value - minus) - minus : int64_t(int_value));
+    }
+    return p;
+}
+
+// 1行を読み取り、読み取った欄ごとにstore(欄の番号, 欄)を呼ぶ。行全体を読み取れたらtrueを返す
+template <typename T_STORE>
+bool VskScanner::scan_fields(const char *line, size_t len, size_t max_fields, size_t& count,
+                             T_STORE store) const
+{
+    const char *p = line, *end = line + len;
+    count = 0;
+    if (m_items.empty())
+        return false;
+
+    const size_t num_items = m_items.size();
+    for (size_t i = 0, next = (num_items > 1); p < end && count < max_fields;
+         i = next, next = (next + 1 < num_items ? next + 1 : 0)) {
+        const VskFormatItem& item = m_items[i];
+        const VskString& pre = item.m_pre_literal;
+        const VskString& post = item.m_post_literal;
+        const char *start = p;
+
+        VskScanField field;
+        field.m_type = item.m_type;
+        field.m_str = p;
+
+        // 前に付くテキスト
+        bool pre_matched = (size_t(end - p) >= pre.size() && std::memcmp(p, pre.data(), pre.size()) == 0);
+
+        // 無効な数値や無限大は前後のテキストを伴わないので、前に付くテキストより先に調べる。
+        // ただし、前に付くテキストそのものが目印で始まるなら目印とはみなさない
+        if (item.m_type == UT_NUMERIC) {
+            if (end - p >= 3 && std::memcmp(p, "NaN", 3) == 0) {
+                field.m_dbl = std::numeric_limits<VskDouble>::quiet_NaN();
+                field.m_len = 3;
+            } else if (end - p >= 4 && (std::memcmp(p, " INF", 4) == 0 || std::memcmp(p, "-INF", 4) == 0)) {
+                field.m_dbl = (*p == '-' ? -1 : 1) * std::numeric_limits<VskDouble>::infinity();
+                field.m_len = 4;
+            }
+            if (pre_matched && field.m_len && pre.size() >= field.m_len)
+                field.m_len = 0;
+            if (field.m_len) {
+                p += field.m_len;
+                store(count++, field);
+                continue;
+            }
+        }
+
+        if (!pre_matched)
+            return false;
+        p += pre.size();
+        field.m_str = p;
+
+        switch (item.m_type) {
+        case UT_NUMERIC:
+            {
+                const char *q = vsk_scan_numeric(item, p, end, field);
+                if (!q)
+                    return false;
+                field.m_len = q - p;
+                p = q;
+            }
+            break;
+        case UT_FIRSTCHAR:
+            if (p >= end)
+                return false;
+            field.m_len = 1;
+            p += 1;
+            break;
+        case UT_PARTIALSTR:
+            if (size_t(end - p) < item.m_text.size())
+                return false;
+            field.m_len = item.m_text.size();
+            while (field.m_len > 0 && p[field.m_len - 1] == ' ')
+                --field.m_len; // 埋められた空白を取り除く
+            p += item.m_text.size();
+            break;
+        case UT_WHOLESTR:
+            {
+                // 後に付くテキストか次の前に付くテキストまでを文字列とする
+                const VskString& delim = (post.size() ? post : m_items[next].m_pre_literal);
+                const char *q = end;
+                if (delim.size())
+                    q = std::search(p, end, delim.begin(), delim.end());
+                field.m_len = q - p;
+                p = q;
+            }
+            break;
+        case UT_UNKNOWN:
+            break;
+        }
+
+        // 後に付くテキスト
+        if (size_t(end - p) < post.size() || std::memcmp(p, post.data(), post.size()) != 0)
+            return false;
+        p += post.size();
+        store(count++, field);
+
+        if (p == start)
+            break; // 進まなければ終わり
+    }
+
+    return p == end;
+}
+
+// 1行を読み取る。行全体を読み取れたらtrueを返す
+bool VskScanner::scan_line(const char *line, size_t len, VskScanField *fields, size_t max_fields,
+                           size_t& count) const
+{
+    return scan_fields(line, len, max_fields, count, [fields](size_t i, const VskScanField& field) {
+        fields[i] = field;
+    });
+}
+
+// 読み取り専用のメモリーマップトファイル
+struct VskMappedFile {
+    const char *    m_data = nullptr;               // データ
+    size_t          m_size = 0;                     // サイズ
+#ifdef _WIN32
+    HANDLE          m_hFile = INVALID_HANDLE_VALUE; // ファイル
+    HANDLE          m_hMapping = nullptr;           // ファイルマッピング
+#else
+    int             m_fd = -1;                      // ファイル記述子
+#endif
+    VskMappedFile() { }
+    VskMappedFile(const VskMappedFile&) = delete;
+    VskMappedFile& operator=(const VskMappedFile&) = delete;
+    ~VskMappedFile() { close(); }
+    bool open(const char *filename);
+    void close();
+};
+
+// ファイルをマップする
+bool VskMappedFile::open(const char *filename)
+{
+    close();
+#ifdef _WIN32
+    m_hFile = ::CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+                            FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (m_hFile == INVALID_HANDLE_VALUE)
+        return false;
+    LARGE_INTEGER size;
+    if (!::GetFileSizeEx(m_hFile, &size)) {
+        close();
+        return false;
+    }
+    m_size = size_t(size.QuadPart);
+    if (m_size == 0)
+        return true;
+    m_hMapping = ::CreateFileMappingA(m_hFile, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    if (m_hMapping)
+        m_data = static_cast<const char *>(::MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0));
+#else
+    m_fd = ::open(filename, O_RDONLY);
+    if (m_fd < 0)
+        return false;
+    struct stat st;
+    if (::fstat(m_fd, &st) != 0) {
+        close();
+        return false;
+    }
+    m_size = size_t(st.st_size);
+    if (m_size == 0)
+        return true;
+    void *data = ::mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+    if (data != MAP_FAILED) {
+        ::madvise(data, m_size, MADV_SEQUENTIAL);
+        m_data = static_cast<const char *>(data);
+    }
+#endif
+    if (!m_data) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+// マップを解除する
+void VskMappedFile::close()
+{
+#ifdef _WIN32
+    if (m_data) ::UnmapViewOfFile(m_data);
+    if (m_hMapping) ::CloseHandle(m_hMapping);
+    if (m_hFile != INVALID_HANDLE_VALUE) ::CloseHandle(m_hFile);
+    m_hMapping = nullptr;
+    m_hFile = INVALID_HANDLE_VALUE;
+#else
+    if (m_data) ::munmap(const_cast<char *>(m_data), m_size);
+    if (m_fd >= 0) ::close(m_fd);
+    m_fd = -1;
+#endif
+    m_data = nullptr;
+    m_size = 0;
+}
+
+// メモリー上のテキストを行ごとに読み取る。
+// callback(行番号, 欄, 欄の個数, 行全体を読み取れたか)が行ごとに呼ばれる。行番号はfirst_lineから始まる
+template <typename T_CALLBACK>
+void vsk_scan_text(const VskScanner& scanner, const char *text, size_t size, T_CALLBACK callback,
+                   size_t first_line = 1)
+{
+    // 欄の個数に上限はない（書式項目は繰り返される）。足りなくなれば広げる
+    std::vector<VskScanField> fields(std::max<size_t>(scanner.m_items.size(), 16));
+    auto store = [&fields](size_t i, const VskScanField& field) {
+        if (i == fields.size())
+            fields.resize(i * 2);
+        fields[i] = field;
+    };
+    const char *p = text, *end = text + size;
+    for (size_t line_no = first_line; p < end; ++line_no) {
+        const char *eol = static_cast<const char *>(std::memchr(p, '\n', end - p));
+        if (!eol) eol = end;
+        size_t len = eol - p;
+        if (len > 0 && p[len - 1] == '\r')
+            --len;
+        size_t count;
+        bool ok = scanner.scan_fields(p, len, SIZE_MAX, count, store);
+        callback(line_no, fields.data(), count, ok);
+        p = eol + 1;
+    }
+}
+
+// ファイルを行ごとに読み取る
+template <typename T_CALLBACK>
+bool vsk_scan_file(const VskScanner& scanner, const char *filename, T_CALLBACK callback)
+{
+    VskMappedFile file;
+    if (!file.open(filename))
+        return false;
+    vsk_scan_text(scanner, file.m_data, file.m_size, callback);
+    return true;
+}
+
+// 並列に読み取るテキストの塊
+struct VskScanChunk {
+    const char *    m_text;                         // テキスト
+    size_t          m_size;                         // サイズ
+    size_t          m_first_line;                   // 最初の行の行番号
+};
+
+static const size_t s_vsk_scan_chunk_size = 4 << 20;        // 並列に読み取る塊のおよそのサイズ
+
+// fn(0), ..., fn(count - 1)をnum_threads個のスレッドで呼ぶ
+template <typename T_FN>
+void vsk_run_parallel(unsigned num_threads, size_t count, T_FN fn)
+{
+    auto worker = [&](size_t first) {
+        for (size_t i = first; i < count; i += num_threads)
+            fn(i);
+    };
+    std::vector<std::thread> threads;
+    for (unsigned i = 1; i < num_threads && i < count; ++i)
+        threads.emplace_back(worker, i);
+    worker(0);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+// テキストを改行で区切った塊に分け、num_threads個のスレッドで読み取る。
+// callback(スレッド番号, 行番号, 欄, 欄の個数, 行全体を読み取れたか)は複数のスレッドから同時に呼ばれるが、
+// 同じスレッド番号では塊の中の行の順番に呼ばれる。num_threads個の塊を読み終えるたびに、
+// 主スレッドでflush(スレッド番号)が塊の順番に呼ばれる（スレッド番号ごとの結果を順番に出力できる）
+template <typename T_CALLBACK, typename T_FLUSH>
+void vsk_scan_text_parallel(const VskScanner& scanner, const char *text, size_t size, unsigned num_threads,
+                            T_CALLBACK callback, T_FLUSH flush, size_t chunk_size = s_vsk_scan_chunk_size)
+{
+    if (num_threads == 0)
+        num_threads = 1;
+
+    // 改行の直後で区切る
+    std::vector<VskScanChunk> chunks;
+    const char *p = text, *end = text + size;
+    while (p < end) {
+        const char *q = end;
+        if (size_t(end - p) > chunk_size) {
+            q = static_cast<const char *>(std::memchr(p + chunk_size, '\n', end - (p + chunk_size)));
+            q = (q ? q + 1 : end);
+        }
+        chunks.push_back({ p, size_t(q - p), 0 });
+        p = q;
+    }
+
+    // 各塊の最初の行番号を求める（改行を並列に数える）
+    std::vector<size_t> lines(chunks.size());
+    vsk_run_parallel(num_threads, chunks.size(), [&](size_t i) {
+        size_t n = 0;
+        const char *r = chunks[i].m_text, *chunk_end = r + chunks[i].m_size;
+        while ((r = static_cast<const char *>(std::memchr(r, '\n', chunk_end - r))) != nullptr) {
+            ++n;
+            ++r;
+        }
+        lines[i] = n;
+    });
+    size_t line_no = 1;
+    for (size_t i = 0; i < chunks.size(); ++i) {
+        chunks[i].m_first_line = line_no;
+        line_no += lines[i];
+    }
+
+    // num_threads個の塊ずつ読み取る
+    for (size_t base = 0; base < chunks.size(); base += num_threads) {
+        size_t n = std::min<size_t>(num_threads, chunks.size() - base);
+        vsk_run_parallel(num_threads, n, [&](size_t i) {
+            const VskScanChunk& chunk = chunks[base + i];
+            vsk_scan_text(scanner, chunk.m_text, chunk.m_size,
+                [&](size_t line, const VskScanField *fields, size_t count, bool complete) {
+                    callback(unsigned(i), line, fields, count, complete);
+                }, chunk.m_first_line);
+        });
+        for (size_t i = 0; i < n; ++i)
+            flush(unsigned(i));
+    }
+}
+
+// ファイルを行ごとに並列に読み取る
+template <typename T_CALLBACK, typename T_FLUSH>
+bool vsk_scan_file_parallel(const VskScanner& scanner, const char *filename, unsigned num_threads,
+                            T_CALLBACK callback, T_FLUSH flush)
+{
+    VskMappedFile file;
+    if (!file.open(filename))
+        return false;
+    vsk_scan_text_parallel(scanner, file.m_data, file.m_size, num_threads, callback, flush);
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 固定長のバイナリレコードを直接整形する
+
+// レコードの欄の型
+enum VskFieldType {
+    VSK_FIELD_INT32,                                // int32_t（単精度として整形する）
+    VSK_FIELD_INT64,                                // int64_t（倍精度として整形する）
+    VSK_FIELD_FLOAT,                                // float
+    VSK_FIELD_DOUBLE,                               // double
+    VSK_FIELD_CHARS,                                // 固定長の文字列（NULがあればそこまで）
+};
+
+// レコードの欄の配置
+struct VskRecordField {
+    VskFieldType    m_type = VSK_FIELD_INT32;       // 型
+    size_t          m_offset = 0;                   // レコードの先頭からの位置
+    size_t          m_size = 0;                     // サイズ（VSK_FIELD_CHARSの長さ）
+};
+
+// レコードの配置（欄とレコードのサイズ）
+struct VskRecordLayout {
+    std::vector<VskRecordField> m_fields;           // 欄
+    size_t          m_record_size = 0;              // レコードのサイズ
+    static const size_t s_max_size = 1 << 20;       // 位置とサイズの上限
+    bool parse(const char *text);
+};
+
+// 配置を表すテキストを解析する。
+// "型[@位置],..."の形で、最後に"/サイズ"を付けられる。型は"i32", "i64", "f32", "f64", "c長さ"。
+// 位置を省略すると直前の欄の直後、サイズを省略すると最後の欄の直後までになる。
+// 位置やサイズがs_max_sizeを超えると失敗する
+bool VskRecordLayout::parse(const char *text)
+{
+    m_fields.clear();
+    m_record_size = 0;
+
+    const char *p = text;
+    size_t next_offset = 0;
+    while (*p && *p != '/') {
+        VskRecordField field;
+        char *end;
+        if (p[0] == 'i' && p[1] == '3' && p[2] == '2') {
+            field.m_type = VSK_FIELD_INT32;
+            field.m_size = 4;
+            p += 3;
+        } else if (p[0] == 'i' && p[1] == '6' && p[2] == '4') {
+            field.m_type = VSK_FIELD_INT64;
+            field.m_size = 8;
+            p += 3;
+        } else if (p[0] == 'f' && p[1] == '3' && p[2] == '2') {
+            field.m_type = VSK_FIELD_FLOAT;
+            field.m_size = 4;
+            p += 3;
+        } else if (p[0] == 'f' && p[1] == '6' && p[2] == '4') {
+            field.m_type = VSK_FIELD_DOUBLE;
+            field.m_size = 8;
+            p += 3;
+        } else if (p[0] == 'c' && '1' <= p[1] && p[1] <= '9') {
+            field.m_type = VSK_FIELD_CHARS;
+            field.m_size = std::strtoul(p + 1, &end, 10);
+            if (field.m_size > s_max_size)
+                return false;
+            p = end;
+        } else {
+            return false;
+        }
+
+        field.m_offset = next_offset;
+        if (*p == '@') {
+            if (p[1] < '0' || '9' < p[1])
+                return false;
+            field.m_offset = std::strtoul(p + 1, &end, 10);
+            p = end;
+        }
+        if (field.m_offset > s_max_size - field.m_size)
+            return false;
+        next_offset = field.m_offset + field.m_size;
+        m_record_size = std::max(m_record_size, next_offset);
+        m_fields.push_back(field);
+
+        if (*p == ',')
+            ++p;
+        else if (*p && *p != '/')
+            return false;
+    }
+
+    if (*p == '/') {
+        char *end;
+        size_t size = std::strtoul(p + 1, &end, 10);
+        if (end == p + 1 || *end || size < m_record_size || size > s_max_size)
+            return false;
+        m_record_size = size;
+    }
+    return !m_fields.empty();
+}
+
+// レコードの配置を書式に結び付けたもの。
+// 各レコードを「PRINT USING 書式; 欄1, 欄2, ...」のように1行に整形する
+struct VskRecordFormatter {
+    std::vector<VskFormatItem>  m_items;            // 書式項目
+    VskRecordLayout m_layout;                       // レコードの配置
+    bool compile(const VskString& format, const VskRecordLayout& layout,
+                 VskDialect dialect = VSK_DIALECT_DEFAULT, bool memo = false);
+    // 数値書式の結果のメモを更新するのでconstではない
+    void write_record(VskWriter& writer, const char *record);
+    void write_records(VskWriter& writer, const void *data, size_t count);
+};
+
+// 書式をコンパイルし、欄の型が書式項目と合うか確かめる。
+// memoがtrueなら数値の書式項目で結果のメモを使う（同じ値が繰り返し現れるとき速い）
+bool VskRecordFormatter::compile(const VskString& format, const VskRecordLayout& layout, VskDialect dialect,
+                                 bool memo)
+{
+    if (!vsk_parse_formats(m_items, format, dialect) || layout.m_fields.empty())
+        return false;
+    for (size_t i = 0; i < layout.m_fields.size(); ++i) {
+        auto& field = layout.m_fields[i];
+        auto& item = m_items[i % m_items.size()];
+        if (field.m_size > layout.m_record_size || field.m_offset > layout.m_record_size - field.m_size)
+            return false;
+        if (item.m_type != UT_UNKNOWN && (item.m_type == UT_NUMERIC) != (field.m_type != VSK_FIELD_CHARS))
+            return false; // Type mismatch
+    }
+    if (memo) {
+        for (auto& item : m_items) {
+            if (item.m_type == UT_NUMERIC)
+                item.enable_memo();
+        }
+    }
+    m_layout = layout;
+    return true;
+}
+
+// 1つのレコードを整形する
+void VskRecordFormatter::write_record(VskWriter& writer, const char *record)
+{
+    size_t iitem = 0;
+    for (auto& field : m_layout.m_fields) {
+        auto& item = m_items[iitem];
+        if (++iitem == m_items.size())
+            iitem = 0;
+
+        const char *p = record + field.m_offset;
+        if (item.m_type == UT_UNKNOWN) {
+            item.write_string(writer, "", 0);
+            continue;
+        }
+        switch (field.m_type) {
+        case VSK_FIELD_INT32:
+            {
+                int32_t value;
+                std::memcpy(&value, p, sizeof(value));
+                item.write_numeric_memo(writer, value, false);
+            }
+            break;
+        case VSK_FIELD_INT64:
+            {
+                int64_t value;
+                std::memcpy(&value, p, sizeof(value));
+                item.write_numeric_memo(writer, VskDouble(value), true);
+            }
+            break;
+        case VSK_FIELD_FLOAT:
+            {
+                float value;
+                std::memcpy(&value, p, sizeof(value));
+                item.write_numeric_memo(writer, value, false);
+            }
+            break;
+        case VSK_FIELD_DOUBLE:
+            {
+                VskDouble value;
+                std::memcpy(&value, p, sizeof(value));
+                item.write_numeric_memo(writer, value, true);
+            }
+            break;
+        case VSK_FIELD_CHARS:
+            {
+                auto nul = static_cast<const char *>(std::memchr(p, 0, field.m_size));
+                item.write_string(writer, p, nul ? size_t(nul - p) : field.m_size);
+            }
+            break;
+        }
+    }
+    writer.put('\n');
+}
+
+// レコードの配列を整形する
+void VskRecordFormatter::write_records(VskWriter& writer, const void *data, size_t count)
+{
+    auto record = static_cast<const char *>(data);
+    for (size_t i = 0; i < count; ++i, record += m_layout.m_record_size)
+        write_record(writer, record);
+}
+
+// ファイルのレコードを整形する。端数のバイト数をremainderに返す
+bool vsk_render_file(VskRecordFormatter& formatter, const char *filename, VskWriter& writer,
+                     size_t& remainder)
+{
+    VskMappedFile file;
+    if (!file.open(filename))
+        return false;
+    const size_t record_size = formatter.m_layout.m_record_size;
+    formatter.write_records(writer, file.m_data, file.m_size / record_size);
+    remainder = file.m_size % record_size;
+    return true;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// 集約出力：前後のテキストをコピーせず、iovecのリストとして出力する
+
+// iovecのリストを送る関数。失敗したら0を返す（Windowsのiovecはprint_using.hで定義する）
+typedef PRINT_USING_IOV_SINK VskGatherSink;
+
+// 集約出力の出力先。書式項目の前後のテキストは書式項目の文字列を指すiovecになり、
+// 整形した欄だけが作業用バッファーに書き込まれる。ただし、iovecを増やすよりも
+// コピーするほうが安い短いテキストは、作業用バッファーにコピーする。
+// iovecかバッファーが一杯になるか、flush()を呼ぶとm_sinkに送られる。
+// 送られるまで書式項目を変更してはならない
+struct VskGatherWriter : VskWriter {
+    static const int s_max_iov = 1024;              // iovecの最大数（IOV_MAX）
+    static const size_t s_min_literal = 256;        // 参照するテキストの最小の長さ
+    VskGatherSink   m_sink;                         // 送る関数
+    void *          m_context;                      // 関数に渡すデータ
+    PRINT_USING_IOVEC m_iov[s_max_iov];             // iovecのリスト
+    int             m_count = 0;                    // iovecの個数
+    size_t          m_pending = 0;                  // iovecになっていないバッファーの位置
+    bool            m_failed = false;               // 送るのに失敗したか？
+    char            m_scratch[16384];               // 作業用バッファー
+
+    VskGatherWriter(VskGatherSink sink, void *context)
+        : VskWriter(m_scratch, sizeof(m_scratch), flush_gather), m_sink(sink), m_context(context)
+    {
+        m_literal = put_gather;
+    }
+    ~VskGatherWriter() { flush(); }
+
+    void push(const char *str, size_t len) {
+        if (m_count == s_max_iov)
+            send();
+        m_iov[m_count].iov_base = const_cast<char *>(str);
+        m_iov[m_count].iov_len = len;
+        ++m_count;
+    }
+    // バッファーの未処理の部分をiovecにする
+    void commit() {
+        if (m_count == s_max_iov)
+            send();
+        if (m_len > m_pending) {
+            push(m_buf + m_pending, m_len - m_pending);
+            m_pending = m_len;
+        }
+    }
+    // iovecのリストを送り、未処理の部分をバッファーの先頭に移す
+    void send() {
+        if (m_count && !m_sink(m_context, m_iov, m_count))
+            m_failed = true;
+        m_count = 0;
+        std::memmove(m_buf, m_buf + m_pending, m_len - m_pending);
+        m_len -= m_pending;
+        m_pending = 0;
+    }
+
+    static void flush_gather(VskWriter& writer) {
+        auto& self = static_cast<VskGatherWriter&>(writer);
+        self.commit();
+        self.send();
+    }
+    static void put_gather(VskWriter& writer, const char *str, size_t len) {
+        auto& self = static_cast<VskGatherWriter&>(writer);
+        if (len < s_min_literal) {
+            self.put(str, len);
+            return;
+        }
+        self.commit();
+        self.push(str, len);
+    }
+};
+
+// iovecのリストをファイル記述子に書き込む集約出力の出力先。contextはint *
+extern "C"
+int print_using_fd_iov_sink(void *context, PRINT_USING_IOVEC *iov, int count)
+{
+    const int fd = *static_cast<int *>(context);
+    while (count > 0) {
+#ifdef _WIN32
+        if (::_write(fd, iov->iov_base, unsigned(iov->iov_len)) != int(iov->iov_len))
+            return 0;
+        ++iov;
+        --count;
+#else
+        ssize_t written = ::writev(fd, iov, count);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written < 0)
+            return 0;
+        // 途中まで書き込まれたら、残りから続ける
+        while (count > 0 && size_t(written) >= iov->iov_len) {
+            written -= iov->iov_len;
+            ++iov;
+            --count;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<char *>(iov->iov_base) + written;
+            iov->iov_len -= written;
+        }
+#endif
+    }
+    return 1;
+}
+#endif  // ndef PRINT_USING_MINIMAL
+
+// C言語の方言の値を変換する
+static VskDialect vsk_dialect_from_c(PRINT_USING_DIALECT dialect)
+{
+    switch (dialect) {
+    case PRINT_USING_DIALECT_YEN:       return VSK_DIALECT_YEN;
+    case PRINT_USING_DIALECT_DOLLAR:    return VSK_DIALECT_DOLLAR;
+    default:                            return VSK_DIALECT_DEFAULT;
+    }
+}
+
+// 評価前の前後のテキストを付けて、数値書式を出力する
+static void vsk_write_numeric_field(VskWriter& writer, const VskFormatSpec& spec,
+                                    const char *pre, size_t pre_len, const char *post, size_t post_len,
+                                    VskDouble d, bool is_double)
+{
+    if (vsk_write_nonfinite(writer, d))
+        return;
+    vsk_write_literal(writer, pre, pre_len);
+    s_vsk_kernels[spec.m_kernel].m_numeric(spec, writer, d, is_double);
+    vsk_write_literal(writer, post, post_len);
+}
+
+// 評価前の前後のテキストを付けて、文字列書式を出力する
+static void vsk_write_string_field(VskWriter& writer, const VskFormatSpec& spec,
+                                   const char *pre, size_t pre_len, const char *post, size_t post_len,
+                                   const char *str, size_t len)
+{
+    vsk_write_literal(writer, pre, pre_len);
+    s_vsk_kernels[spec.m_kernel].m_string(spec, writer, str, len);
+    vsk_write_literal(writer, post, post_len);
+}
+
+// 書式文字列を字句ごとに整形して出力する。書式項目を保持せず、メモリーを確保しない。
+// 書式項目がなければfalseを返す
+template <typename T_DIALECT>
+static bool vsk_write_using(VskWriter& writer, const char *format, va_list va)
+{
+    VskFormatTokenizer<T_DIALECT> tokenizer(format, std::strlen(format));
+    VskFormatToken token;
+    bool found = false;
+    while (tokenizer.next(token)) {
+        found = true;
+        const char *pre = format + token.m_pre_pos;
+        const char *post = format + token.m_post_pos;
+        const size_t pre_len = token.m_text_pos - token.m_pre_pos;
+        const size_t post_len = token.m_end_pos - token.m_post_pos;
+        if (token.m_type == UT_NUMERIC) {
+            VskDouble d = va_arg(va, VskDouble);
+            vsk_write_numeric_field(writer, token, pre, pre_len, post, post_len, d, true);
+        } else {
+            const char *str = (token.m_type == UT_UNKNOWN) ? "" : va_arg(va, const char *);
+            vsk_write_string_field(writer, token, pre, pre_len, post, post_len, str, std::strlen(str));
+        }
+    }
+    return found;
+}
+
+// 書式文字列を字句ごとに整形して出力する（方言を実行時に選ぶ）
+static bool vsk_write_using(VskWriter& writer, const char *format, va_list va, VskDialect dialect)
+{
+    if (dialect == VSK_DIALECT_YEN)
+        return vsk_write_using<VskDialectYen>(writer, format, va);
+    return vsk_write_using<VskDialectDollar>(writer, format, va);
+}
+
+extern "C"
+void vsprint_using_dialect(PRINT_USING_DIALECT dialect, char *buffer, size_t buffer_size, const char *format, va_list va)
+{
+    // 呼び出し側のバッファーに直接書き込む。あふれた分は捨てる
+    VskWriter writer(buffer, buffer_size ? buffer_size - 1 : 0);
+    if (!vsk_write_using(writer, format, va, vsk_dialect_from_c(dialect)))
+        std::fprintf(stderr, "Illegal function call\n");
+    if (buffer_size > 0)
+        buffer[writer.m_len] = 0;
+}
+
+extern "C"
+void sprint_using_dialect(PRINT_USING_DIALECT dialect, char *buffer, size_t buffer_size, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    vsprint_using_dialect(dialect, buffer, buffer_size, format, va);
+    va_end(va);
+}
+
+extern "C"
+int vprint_using_dialect(PRINT_USING_DIALECT dialect, const char *format, va_list va)
+{
+    VskFileWriter writer(stdout);
+    if (!vsk_write_using(writer, format, va, vsk_dialect_from_c(dialect)))
+        std::fprintf(stderr, "Illegal function call\n");
+    writer.put('\n');
+    writer.flush();
+    return int(writer.m_total);
+}
+
+extern "C"
+int print_using_dialect(PRINT_USING_DIALECT dialect, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    int ret = vprint_using_dialect(dialect, format, va);
+    va_end(va);
+    return ret;
+}
+
+extern "C"
+void vsprint_using(char *buffer, size_t buffer_size, const char *format, va_list va)
+{
+    vsprint_using_dialect(PRINT_USING_DIALECT_DEFAULT, buffer, buffer_size, format, va);
+}
+
+extern "C"
+void sprint_using(char *buffer, size_t buffer_size, const char *format, ...)
+{
+    va_list va;
+    va_start(va, format);
+    vsprint_using(buffer, buffer_size, format, va);
+    va_end(va);
+}
+
+extern "C"
+int vprint_using(const char *format, va_list va)
+{
+    return vprint_using_dialect(PRINT_USING_DIALECT_DEFAULT, format, va);
+}
+
+extern "C"
+int print_using(const char *format, ...)
+{
+    va_list va;
     va_start(va, format);
     int ret = vprint_using(format, va);
     va_end(va);
     return ret;
 }
 
-#ifndef NDEBUG
+// PRINT_USING_ITEMの中に書式項目の仕様を保存できるか？
+static_assert(sizeof(VskFormatSpec) <= sizeof(PRINT_USING_ITEM().spec), "PRINT_USING_ITEM is too small");
+
+// 1つの書式項目をコンパイルする。書式項目がちょうど1つでなければfalseを返す
+template <typename T_DIALECT>
+static bool vsk_compile_item(PRINT_USING_ITEM *item, const char *format, size_t len)
+{
+    VskFormatTokenizer<T_DIALECT> tokenizer(format, len);
+    VskFormatToken token;
+    if (!tokenizer.next(token) || token.m_type == UT_UNKNOWN || token.m_end_pos != len)
+        return false;
+
+    const VskFormatSpec& spec = token;
+    std::memcpy(item->spec.data, &spec, sizeof(spec));
+    item->pre = format + token.m_pre_pos;
+    item->pre_len = token.m_text_pos - token.m_pre_pos;
+    item->post = format + token.m_post_pos;
+    item->post_len = token.m_end_pos - token.m_post_pos;
+    item->numeric = (token.m_type == UT_NUMERIC);
+    return true;
+}
+
+extern "C"
+int print_using_compile_item(PRINT_USING_ITEM *item, PRINT_USING_DIALECT dialect, const char *format, size_t len)
+{
+    if (vsk_dialect_from_c(dialect) == VSK_DIALECT_YEN)
+        return vsk_compile_item<VskDialectYen>(item, format, len);
+    return vsk_compile_item<VskDialectDollar>(item, format, len);
+}
+
+extern "C"
+void print_using_format_number(const PRINT_USING_ITEM *item, double value, int is_double,
+                               PRINT_USING_SINK sink, void *context)
+{
+    VskFormatSpec spec;
+    std::memcpy(&spec, item->spec.data, sizeof(spec));
+    assert(spec.m_type == UT_NUMERIC);
+    VskSinkWriter writer(sink, context);
+    vsk_write_numeric_field(writer, spec, item->pre, item->pre_len, item->post, item->post_len,
+                            value, is_double != 0);
+}
+
+extern "C"
+void print_using_format_string(const PRINT_USING_ITEM *item, const char *str, size_t len,
+                               PRINT_USING_SINK sink, void *context)
+{
+    VskFormatSpec spec;
+    std::memcpy(&spec, item->spec.data, sizeof(spec));
+    assert(spec.m_type != UT_NUMERIC);
+    VskSinkWriter writer(sink, context);
+    vsk_write_string_field(writer, spec, item->pre, item->pre_len, item->post, item->post_len, str, len);
+}
+
+#ifndef PRINT_USING_MINIMAL
+/////////////////////////////////////////////////////////////////////////////
+// 遅延ログ：引数のバイト列だけを記録し、整形は別のスレッドかデコーダーで行う
+
+static const int s_vsk_log_max_formats = 4096;              // 登録できる書式の最大数
+static const size_t s_vsk_log_max_string = 255;             // 記録する文字列の最大長
+static const size_t s_vsk_log_ring_size = 64 * 1024;        // リングバッファーのサイズ（2の累乗）
+static const size_t s_vsk_log_max_format = 64 * 1024;       // 登録できる書式の最大長
+static const char s_vsk_log_signature[4] = { 'P', 'U', 'L', 'G' }; // バイナリーログの署名
+static const uint32_t s_vsk_log_version = 1;                // バイナリーログの版
+
+// 登録された書式
+struct VskLogFormat {
+    VskString                   m_format;           // 書式文字列
+    VskDialect                  m_dialect;          // 方言
+    std::vector<VskFormatItem>  m_items;            // 書式項目
+    VskString                   m_args;             // 引数の種類（'d'は数値、's'は文字列）
+    bool compile(const VskString& format, VskDialect dialect);
+};
+
+// 書式をコンパイルする
+bool VskLogFormat::compile(const VskString& format, VskDialect dialect)
+{
+    m_format = format;
+    m_dialect = dialect;
+    m_args.clear();
+    if (!vsk_parse_formats(m_items, format, dialect))
+        return false;
+    for (auto& item : m_items) {
+        if (item.m_type == UT_NUMERIC)
+            m_args += 'd';
+        else if (item.m_type != UT_UNKNOWN)
+            m_args += 's';
+    }
+    return true;
+}
+
+// スレッドごとのリングバッファー（書き手と読み手が1つずつ）。
+// レコードは [uint32_t サイズ][uint32_t 書式ID][引数のバイト列] の形をとる。
+// 書き手のスレッドが終わると引退し、空になったら整形するスレッドが解放する
+struct VskLogRing {
+    std::atomic<size_t> m_head;                     // 書き込み位置（書き手だけが更新する）
+    std::atomic<size_t> m_tail;                     // 読み込み位置（読み手だけが更新する）
+    std::atomic<bool>   m_retired;                  // 書き手のスレッドが終わったか？
+    char                m_data[s_vsk_log_ring_size];
+
+    VskLogRing() : m_head(0), m_tail(0), m_retired(false) { }
+
+    void write(size_t pos, const void *data, size_t len) {
+        pos &= s_vsk_log_ring_size - 1;
+        size_t count = std::min(len, s_vsk_log_ring_size - pos);
+        std::memcpy(&m_data[pos], data, count);
+        std::memcpy(&m_data[0], static_cast<const char *>(data) + count, len - count);
+    }
+    void read(size_t pos, void *data, size_t len) const {
+        pos &= s_vsk_log_ring_size - 1;
+        size_t count = std::min(len, s_vsk_log_ring_size - pos);
+        std::memcpy(data, &m_data[pos], count);
+        std::memcpy(static_cast<char *>(data) + count, &m_data[0], len - count);
+    }
+};
+
+// 遅延ログの状態
+struct VskLogger {
+    std::mutex                              m_mutex;            // 登録用の排他制御
+    std::unique_ptr<VskLogFormat>           m_formats[s_vsk_log_max_formats]; // 登録された書式
+    std::atomic<int>                        m_num_formats;      // 登録された書式の個数
+    std::vector<std::shared_ptr<VskLogRing>> m_rings;           // スレッドごとのリングバッファー
+    std::atomic<unsigned>                   m_generation;       // 開いた回数
+    std::atomic<bool>                       m_open;             // 開いているか？
+    std::atomic<bool>                       m_stop;             // 止めるか？
+    std::atomic<size_t>                     m_dropped;          // 捨てたレコードの個数
+    std::thread                             m_thread;           // 整形するスレッド
+    FILE *                                  m_fp = nullptr;     // 出力先
+    bool                                    m_binary = false;   // バイナリーで記録するか？
+    bool                                    m_close_fp = false; // 閉じるときにm_fpも閉じるか？
+
+    VskLogger() : m_num_formats(0), m_generation(0), m_open(false), m_stop(false), m_dropped(0) { }
+    ~VskLogger();
+};
+
+static VskLogger s_vsk_logger;
+
+// スレッドが使うリングバッファー。スレッドが終わったらリングバッファーを引退させる
+struct VskLogRingOwner {
+    std::shared_ptr<VskLogRing> m_ring;             // リングバッファー
+    unsigned                    m_generation = 0;   // 取得したときのm_generation
+
+    ~VskLogRingOwner() {
+        if (m_ring)
+            m_ring->m_retired.store(true, std::memory_order_release);
+    }
+};
+static thread_local VskLogRingOwner s_vsk_log_ring_owner;
+
+// 書式を登録する。書式IDを返す。失敗したら-1を返す
+int vsk_log_register(const VskString& format, VskDialect dialect = VSK_DIALECT_DEFAULT)
+{
+    VskLogger& logger = s_vsk_logger;
+    if (format.size() > s_vsk_log_max_format)
+        return -1;
+    std::unique_ptr<VskLogFormat> log_format(new VskLogFormat());
+    if (!log_format->compile(format, dialect))
+        return -1;
+
+    std::lock_guard<std::mutex> lock(logger.m_mutex);
+    int id = logger.m_num_formats.load(std::memory_order_relaxed);
+    if (id >= s_vsk_log_max_formats)
+        return -1;
+    logger.m_formats[id] = std::move(log_format);
+    logger.m_num_formats.store(id + 1, std::memory_order_release);
+    return id;
+}
+
+// 記録された引数を書式に従って整形する
+static bool
+vsk_log_format_record(const VskLogFormat& format, const char *data, size_t size, VskWriter& writer)
+{
+    const char *end = data + size;
+    for (auto& item : format.m_items) {
+        if (item.m_type == UT_UNKNOWN) {
+            item.write_string(writer, "", 0);
+        } else if (item.m_type == UT_NUMERIC) {
+            VskDouble d;
+            if (size_t(end - data) < sizeof(d))
+                return false;
+            std::memcpy(&d, data, sizeof(d));
+            data += sizeof(d);
+            item.write_numeric(writer, d, true);
+        } else {
+            if (data >= end || size_t(end - data) < 1u + uint8_t(*data))
+                return false;
+            size_t len = uint8_t(*data++);
+            item.write_string(writer, data, len);
+            data += len;
+        }
+    }
+    writer.put('\n');
+    return data == end;
+}
+
+// 登録されたスレッドのリングバッファーを取得する
+static VskLogRing *vsk_log_thread_ring(void)
+{
+    VskLogger& logger = s_vsk_logger;
+    VskLogRingOwner& owner = s_vsk_log_ring_owner;
+    unsigned generation = logger.m_generation.load(std::memory_order_acquire);
+    if (owner.m_generation != generation) {
+        std::lock_guard<std::mutex> lock(logger.m_mutex);
+        logger.m_rings.push_back(std::make_shared<VskLogRing>());
+        owner.m_ring = logger.m_rings.back();
+        owner.m_generation = generation;
+    }
+    return owner.m_ring.get();
+}
+
+// 引数のバイト列をリングバッファーに記録する。整形はしない
+bool vsk_log_va(int id, va_list va)
+{
+    VskLogger& logger = s_vsk_logger;
+    if (!logger.m_open.load(std::memory_order_acquire))
+        return false;
+    if (id < 0 || id >= logger.m_num_formats.load(std::memory_order_acquire))
+        return false;
+    const VskLogFormat& format = *logger.m_formats[id];
+    VskLogRing *ring = vsk_log_thread_ring();
+
+    const size_t head = ring->m_head.load(std::memory_order_relaxed);
+    const size_t room = s_vsk_log_ring_size - (head - ring->m_tail.load(std::memory_order_acquire));
+    size_t pos = 2 * sizeof(uint32_t);
+    for (char type : format.m_args) {
+        if (type == 'd') {
+            VskDouble d = va_arg(va, VskDouble);
+            if (pos + sizeof(d) > room) {
+                pos = room + 1;
+                break;
+            }
+            ring->write(head + pos, &d, sizeof(d));
+            pos += sizeof(d);
+        } else {
+            const char *str = va_arg(va, const char *);
+            size_t len = 0;
+            while (len < s_vsk_log_max_string && str[len]) ++len;
+            if (pos + 1 + len > room) {
+                pos = room + 1;
+                break;
+            }
+            uint8_t len8 = uint8_t(len);
+            ring->write(head + pos, &len8, 1);
+            ring->write(head + pos + 1, str, len);
+            pos += 1 + len;
+        }
+    }
+    if (pos > room) { // 空きがなければ捨てる
+        logger.m_dropped.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    uint32_t header[2] = { uint32_t(pos), uint32_t(id) };
+    ring->write(head, header, sizeof(header));
+    ring->m_head.store(head + pos, std::memory_order_release);
+    return true;
+}
+
+// バイナリーログに書式の定義を書き込む
+static void vsk_log_write_format(VskWriter& writer, int id, const VskLogFormat& format)
+{
+    uint32_t id32 = uint32_t(id), len32 = uint32_t(format.m_format.size());
+    uint8_t dialect = uint8_t(format.m_dialect);
+    writer.put('F');
+    writer.put(reinterpret_cast<const char *>(&id32), sizeof(id32));
+    writer.put(reinterpret_cast<const char *>(&dialect), sizeof(dialect));
+    writer.put(reinterpret_cast<const char *>(&len32), sizeof(len32));
+    writer.put(format.m_format);
+}
+
+// リングバッファーに溜まったレコードを整形か記録する。何か処理したらtrueを返す
+static bool vsk_log_drain(VskWriter& writer, std::vector<char>& record, int& num_written_formats)
+{
+    VskLogger& logger = s_vsk_logger;
+    std::vector<VskLogRing *> rings;
+    {
+        std::lock_guard<std::mutex> lock(logger.m_mutex);
+        for (auto& ring : logger.m_rings)
+            rings.push_back(ring.get());
+    }
+
+    bool processed = false, retired = false;
+    for (auto ring : rings) {
+        // 引退を先に確かめれば、この後に読むm_headが最後のレコードの後になる
+        if (ring->m_retired.load(std::memory_order_acquire))
+            retired = true;
+        size_t tail = ring->m_tail.load(std::memory_order_relaxed);
+        const size_t head = ring->m_head.load(std::memory_order_acquire);
+        if (tail != head)
+            processed = true;
+        while (tail != head) {
+            uint32_t header[2];
+            ring->read(tail, header, sizeof(header));
+            const size_t size = header[0] - sizeof(header);
+            record.resize(size);
+            ring->read(tail + sizeof(header), record.data(), size);
+            tail += header[0];
+
+            const int id = int(header[1]);
+            if (logger.m_binary) {
+                const int num_formats = logger.m_num_formats.load(std::memory_order_acquire);
+                for (; num_written_formats < num_formats; ++num_written_formats)
+                    vsk_log_write_format(writer, num_written_formats, *logger.m_formats[num_written_formats]);
+                uint32_t size32 = uint32_t(size);
+                writer.put('R');
+                writer.put(reinterpret_cast<const char *>(&header[1]), sizeof(header[1]));
+                writer.put(reinterpret_cast<const char *>(&size32), sizeof(size32));
+                writer.put(record.data(), size);
+            } else {
+                vsk_log_format_record(*logger.m_formats[id], record.data(), size, writer);
+            }
+        }
+        ring->m_tail.store(tail, std::memory_order_release);
+    }
+
+    // 引退して空になったリングバッファーを解放する
+    if (retired) {
+        std::lock_guard<std::mutex> lock(logger.m_mutex);
+        auto& all = logger.m_rings;
+        all.erase(std::remove_if(all.begin(), all.end(), [](const std::shared_ptr<VskLogRing>& ring) {
+            return ring->m_retired.load(std::memory_order_acquire) &&
+                   ring->m_tail.load(std::memory_order_relaxed) == ring->m_head.load(std::memory_order_acquire);
+        }), all.end());
+    }
+    return processed;
+}
+
+// 整形するスレッド
+static void vsk_log_thread_proc(void)
+{
+    VskLogger& logger = s_vsk_logger;
+    VskFileWriter writer(logger.m_fp);
+    std::vector<char> record;
+    int num_written_formats = 0;
+
+    if (logger.m_binary) {
+        writer.put(s_vsk_log_signature, sizeof(s_vsk_log_signature));
+        writer.put(reinterpret_cast<const char *>(&s_vsk_log_version), sizeof(s_vsk_log_version));
+    }
+
+    for (;;) {
+        bool stop = logger.m_stop.load(std::memory_order_acquire);
+        if (!vsk_log_drain(writer, record, num_written_formats)) {
+            if (stop)
+                break;
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        writer.flush();
+    }
+    writer.flush();
+    std::fflush(logger.m_fp);
+}
+
+// 遅延ログを開始する
+bool vsk_log_open(FILE *fp, bool binary, bool close_fp = false)
+{
+    VskLogger& logger = s_vsk_logger;
+    if (!fp || logger.m_open.load())
+        return false;
+
+    logger.m_fp = fp;
+    logger.m_binary = binary;
+    logger.m_close_fp = close_fp;
+    logger.m_dropped = 0;
+    logger.m_stop = false;
+    logger.m_generation.fetch_add(1, std::memory_order_release);
+    logger.m_thread = std::thread(vsk_log_thread_proc);
+    logger.m_open.store(true, std::memory_order_release);
+    return true;
+}
+
+// 遅延ログを終了する。記録中のスレッドがないときに呼ぶこと
+void vsk_log_close(void)
+{
+    VskLogger& logger = s_vsk_logger;
+    if (!logger.m_open.exchange(false))
+        return;
+
+    logger.m_stop.store(true, std::memory_order_release);
+    logger.m_thread.join();
+    if (logger.m_close_fp)
+        std::fclose(logger.m_fp);
+    logger.m_fp = nullptr;
+
+    std::lock_guard<std::mutex> lock(logger.m_mutex);
+    logger.m_rings.clear();
+}
+
+VskLogger::~VskLogger()
+{
+    vsk_log_close();
+}
+
+// バイナリーログを読み、整形して出力する
+bool vsk_log_decode(FILE *fp, VskWriter& writer)
+{
+    char signature[sizeof(s_vsk_log_signature)];
+    uint32_t version;
+    if (std::fread(signature, sizeof(signature), 1, fp) != 1 ||
+        std::memcmp(signature, s_vsk_log_signature, sizeof(signature)) != 0 ||
+        std::fread(&version, sizeof(version), 1, fp) != 1 || version != s_vsk_log_version)
+    {
+        return false;
+    }
+
+    std::vector<std::unique_ptr<VskLogFormat>> formats;
+    std::vector<char> data;
+    int tag;
+    while ((tag = std::fgetc(fp)) != EOF) {
+        uint32_t id, len;
+        uint8_t dialect = 0;
+        if (std::fread(&id, sizeof(id), 1, fp) != 1)
+            return false;
+        if (tag == 'F' && std::fread(&dialect, sizeof(dialect), 1, fp) != 1)
+            return false;
+        if (std::fread(&len, sizeof(len), 1, fp) != 1)
+            return false;
+        // 壊れた長さで大きなバッファーを確保しない。レコードはリングバッファーに収まる
+        if (len > (tag == 'F' ? s_vsk_log_max_format : s_vsk_log_ring_size))
+            return false;
+        if (tag == 'F' && dialect != VSK_DIALECT_YEN && dialect != VSK_DIALECT_DOLLAR)
+            return false;
+        data.resize(len);
+        if (len && std::fread(data.data(), len, 1, fp) != 1)
+            return false;
+
+        if (tag == 'F') {
+            if (id >= uint32_t(s_vsk_log_max_formats))
+                return false;
+            if (formats.size() <= id)
+                formats.resize(id + 1);
+            formats[id].reset(new VskLogFormat());
+            if (!formats[id]->compile(VskString(data.data(), len), VskDialect(dialect)))
+                return false;
+        } else if (tag == 'R') {
+            if (formats.size() <= id || !formats[id])
+                return false;
+            if (!vsk_log_format_record(*formats[id], data.data(), len, writer))
+                return false;
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+extern "C"
+int print_using_log_open(const char *filename, int binary)
+{
+    FILE *fp = std::fopen(filename, binary ? "wb" : "w");
+    if (!fp)
+        return 0;
+    if (!vsk_log_open(fp, binary != 0, true)) {
+        std::fclose(fp);
+        return 0;
+    }
+    return 1;
+}
+
+extern "C"
+int print_using_log_register(PRINT_USING_DIALECT dialect, const char *format)
+{
+    return vsk_log_register(format, vsk_dialect_from_c(dialect));
+}
+
+extern "C"
+int vprint_using_log(int id, va_list va)
+{
+    return vsk_log_va(id, va);
+}
+
+extern "C"
+int print_using_log(int id, ...)
+{
+    va_list va;
+    va_start(va, id);
+    int ret = vprint_using_log(id, va);
+    va_end(va);
+    return ret;
+}
+
+extern "C"
+size_t print_using_log_dropped(void)
+{
+    return s_vsk_logger.m_dropped.load();
+}
+
+extern "C"
+void print_using_log_close(void)
+{
+    vsk_log_close();
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// バイナリレコードの整形のC API
+
+struct PRINT_USING_RECORDS : VskRecordFormatter {
+};
+
+extern "C"
+PRINT_USING_RECORDS *print_using_records_compile(PRINT_USING_DIALECT dialect, const char *format,
+                                                 const char *layout, int flags)
+{
+    VskRecordLayout record_layout;
+    if (!record_layout.parse(layout))
+        return nullptr;
+    auto records = new PRINT_USING_RECORDS();
+    if (!records->compile(format, record_layout, vsk_dialect_from_c(dialect),
+                          (flags & PRINT_USING_RECORDS_MEMO) != 0)) {
+        delete records;
+        return nullptr;
+    }
+    return records;
+}
+
+extern "C"
+size_t print_using_records_size(const PRINT_USING_RECORDS *records)
+{
+    return records->m_layout.m_record_size;
+}
+
+extern "C"
+void print_using_records_format(PRINT_USING_RECORDS *records, const void *data, size_t count,
+                                PRINT_USING_SINK sink, void *context)
+{
+    VskSinkWriter writer(sink, context);
+    records->write_records(writer, data, count);
+}
+
+extern "C"
+int print_using_records_format_iov(PRINT_USING_RECORDS *records, const void *data, size_t count,
+                                   PRINT_USING_IOV_SINK sink, void *context)
+{
+    VskGatherWriter writer(sink, context);
+    records->write_records(writer, data, count);
+    writer.flush();
+    return !writer.m_failed;
+}
+
+extern "C"
+void print_using_records_free(PRINT_USING_RECORDS *records)
+{
+    delete records;
+}
+
+/////////////////////////////////////////////////////////////////////////////
+// PRINT USING文の出力を読み取るC API
+
+struct PRINT_USING_SCANNER : VskScanner {
+};
+
+extern "C"
+PRINT_USING_SCANNER *print_using_scanner_compile(PRINT_USING_DIALECT dialect, const char *format)
+{
+    auto scanner = new PRINT_USING_SCANNER();
+    if (!scanner->compile(format, vsk_dialect_from_c(dialect))) {
+        delete scanner;
+        return nullptr;
+    }
+    return scanner;
+}
+
+extern "C"
+int print_using_scan_line(const PRINT_USING_SCANNER *scanner, const char *line, size_t len,
+                          PRINT_USING_SCAN_FIELD *fields, size_t max_fields, size_t *count)
+{
+    // 読み取った欄をそのまま呼び出し元の配列に書き込む
+    return scanner->scan_fields(line, len, max_fields, *count, [fields](size_t i, const VskScanField& field) {
+        fields[i].str = field.m_str;
+        fields[i].len = field.m_len;
+        fields[i].value = field.m_dbl;
+        fields[i].int_value = field.m_int;
+        fields[i].numeric = (field.m_type == UT_NUMERIC);
+        fields[i].is_int = field.m_is_int;
+        fields[i].is_double = field.m_is_double;
+        fields[i].overflow = field.m_overflow;
+    });
+}
+
+extern "C"
+void print_using_scanner_free(PRINT_USING_SCANNER *scanner)
+{
+    delete scanner;
+}
+#endif  // ndef PRINT_USING_MINIMAL
+
+#ifdef PRINT_USING_TEST
 
 static int s_failure = 0; // vsk_print_usingのテストの失敗回数
 
 // vsk_print_usingのテスト項目
-void vsk_print_using_test_entry(int line, const VskString& text, const VskAstList& args, const VskString& expected)
+void vsk_print_using_test_entry(int line, const VskString& text, const VskAstList& args, const VskString& expected,
+                                VskDialect dialect = VSK_DIALECT_DEFAULT)
 {
     VskString out;
-    if (!vsk_print_using(out, text, args))
+    if (!vsk_print_using(out, text, args, dialect))
     {
-        std::cout << "failed" << std::endl;
+        std::printf("failed\n");
         return;
     }
 
     if (out != expected) {
-        std::cout << "Line " << line << ": '" << text << "', '" << out << "', '" << expected << "'" << std::endl;
+        std::printf("Line %d: '%s', '%s', '%s'\n", line, text.c_str(), out.c_str(), expected.c_str());
         ++s_failure;
     }
 }
@@ -781,17 +2775,16 @@ void vsk_print_using_test(void)
     vsk_print_using_test_entry(__LINE__, "<+##.##>", { vsk_ast(-2.3) }, "< -2.30>");
     vsk_print_using_test_entry(__LINE__, "<**##.##>", { vsk_ast(+2.3) }, "<***2.30>");
     vsk_print_using_test_entry(__LINE__, "<**##.##>", { vsk_ast(-2.3) }, "<**-2.30>");
-#ifdef JAPAN
-    vsk_print_using_test_entry(__LINE__, "<\\\\##.##>", { vsk_ast(+2.3) }, "<  \\2.30>");
-    vsk_print_using_test_entry(__LINE__, "<\\\\##.##>", { vsk_ast(-2.3) }, "< -\\2.30>");
-    vsk_print_using_test_entry(__LINE__, "<**\\##.##>", { vsk_ast(+2.3) }, "<***\\2.30>");
-    vsk_print_using_test_entry(__LINE__, "<**\\##.##>", { vsk_ast(-2.3) }, "<**-\\2.30>");
-#else
-    vsk_print_using_test_entry(__LINE__, "<$$##.##>", { vsk_ast(+2.3) }, "<  $2.30>");
-    vsk_print_using_test_entry(__LINE__, "<$$##.##>", { vsk_ast(-2.3) }, "< -$2.30>");
-    vsk_print_using_test_entry(__LINE__, "<**$##.##>", { vsk_ast(+2.3) }, "<***$2.30>");
-    vsk_print_using_test_entry(__LINE__, "<**$##.##>", { vsk_ast(-2.3) }, "<**-$2.30>");
-#endif
+    vsk_print_using_test_entry(__LINE__, "<\\\\##.##>", { vsk_ast(+2.3) }, "<  \\2.30>", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<\\\\##.##>", { vsk_ast(-2.3) }, "< -\\2.30>", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<**\\##.##>", { vsk_ast(+2.3) }, "<***\\2.30>", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<**\\##.##>", { vsk_ast(-2.3) }, "<**-\\2.30>", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<$$##.##>", { vsk_ast(+2.3) }, "<  $2.30>", VSK_DIALECT_DOLLAR);
+    vsk_print_using_test_entry(__LINE__, "<$$##.##>", { vsk_ast(-2.3) }, "< -$2.30>", VSK_DIALECT_DOLLAR);
+    vsk_print_using_test_entry(__LINE__, "<**$##.##>", { vsk_ast(+2.3) }, "<***$2.30>", VSK_DIALECT_DOLLAR);
+    vsk_print_using_test_entry(__LINE__, "<**$##.##>", { vsk_ast(-2.3) }, "<**-$2.30>", VSK_DIALECT_DOLLAR);
+    vsk_print_using_test_entry(__LINE__, "<$$##>", { vsk_ast(+2) }, "<$$ 2>", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<\\\\##>", { vsk_ast(+2) }, "<\\\\ 2>", VSK_DIALECT_DOLLAR);
     vsk_print_using_test_entry(__LINE__, "###<& &>###", { vsk_ast(23) }, " 23<");
 
     vsk_print_using_test_entry(__LINE__, "<.#>", { vsk_ast(1.28) }, "<%1.3>");
@@ -831,11 +2824,8 @@ void vsk_print_using_test(void)
     vsk_print_using_test_entry(__LINE__, "<##.#^^^^>", { vsk_ast(-3.9999f) }, "<-4.0E+00>");
     vsk_print_using_test_entry(__LINE__, "<#####.####^^^^>", { vsk_ast(1.1f) }, "< 1100.0000E-03>");
     vsk_print_using_test_entry(__LINE__, "<#####.####^^^^>", { vsk_ast(-1.1f) }, "<-1100.0000E-03>");
-#ifdef JAPAN
-    vsk_print_using_test_entry(__LINE__, "<\\\\###.#^^^^>", { vsk_ast(123.456f) }, "<\\1234.6E-01>");
-#else
-    vsk_print_using_test_entry(__LINE__, "<$$###.#^^^^>", { vsk_ast(123.456f) }, "<$1234.6E-01>");
-#endif
+    vsk_print_using_test_entry(__LINE__, "<\\\\###.#^^^^>", { vsk_ast(123.456f) }, "<\\1234.6E-01>", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<$$###.#^^^^>", { vsk_ast(123.456f) }, "<$1234.6E-01>", VSK_DIALECT_DOLLAR);
 
     vsk_print_using_test_entry(__LINE__, "<#.##->", { vsk_ast(-0.2) }, "<0.20->");
     vsk_print_using_test_entry(__LINE__, "<.#+>", { vsk_ast(-0.2) }, "<.2->");
@@ -851,31 +2841,1017 @@ void vsk_print_using_test(void)
     vsk_print_using_test_entry(__LINE__, "#._", { vsk_ast(123.456) }, "%123._");
     vsk_print_using_test_entry(__LINE__, "<_#_@@__>", { vsk_ast("ABC") }, "<#@ABC_>");
     vsk_print_using_test_entry(__LINE__, "_#_@@_", { vsk_ast("ABC") }, "#@ABC_");
-#ifdef JAPAN
-    vsk_print_using_test_entry(__LINE__, "<\\\\###._->", { vsk_ast(123.456) }, "< \\123.->");
+    vsk_print_using_test_entry(__LINE__, "<\\\\###._->", { vsk_ast(123.456) }, "< \\123.->", VSK_DIALECT_YEN);
+    vsk_print_using_test_entry(__LINE__, "<$$###._->", { vsk_ast(123.456) }, "< $123.->", VSK_DIALECT_DOLLAR);
+
+}
+
+// VskScannerのテスト項目
+void vsk_scan_using_test_entry(int line, const VskString& text, const VskAstList& args,
+                               VskDialect dialect = VSK_DIALECT_DEFAULT)
+{
+    VskString out;
+    VskScanner scanner;
+    if (!vsk_print_using(out, text, args, dialect) || !scanner.compile(text, dialect)) {
+        std::printf("Line %d: failed\n", line);
+        ++s_failure;
+        return;
+    }
+
+    VskScanField fields[16];
+    size_t count;
+    bool ok = scanner.scan_line(out.data(), out.size(), fields, 16, count);
+    if (!ok || count != args.size()) {
+        std::printf("Line %d: '%s', '%s', %d fields\n", line, text.c_str(), out.c_str(), int(count));
+        ++s_failure;
+        return;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        auto& arg = args[i];
+        auto& field = fields[i];
+        if (arg->m_type == TYPE_STRING) {
+            if (VskString(field.m_str, field.m_len) != arg->m_str.substr(0, field.m_len)) {
+                std::printf("Line %d: '%s', '%s', field %d\n", line, text.c_str(), out.c_str(), int(i));
+                ++s_failure;
+            }
+            continue;
+        }
+        // 書式で丸めた値と読み取った値を比べる
+        auto& item = scanner.m_items[i % scanner.m_items.size()];
+        VskString again = item.format_numeric(field.m_dbl, arg->m_type == TYPE_DOUBLE);
+        if (again != item.format_numeric(arg->m_dbl, arg->m_type == TYPE_DOUBLE)) {
+            std::printf("Line %d: '%s', '%s', field %d\n", line, text.c_str(), out.c_str(), int(i));
+            ++s_failure;
+        }
+    }
+}
+
+// VskScannerのテスト
+void vsk_scan_using_test(void)
+{
+    vsk_scan_using_test_entry(__LINE__, "##", { vsk_ast(0) });
+    vsk_scan_using_test_entry(__LINE__, "### & & ###", { vsk_ast(23), vsk_ast("ABCDEF"), vsk_ast(9999) });
+    vsk_scan_using_test_entry(__LINE__, "<##.##>", { vsk_ast(-2.3) });
+    vsk_scan_using_test_entry(__LINE__, "<+##.##>", { vsk_ast(+2.3) });
+    vsk_scan_using_test_entry(__LINE__, "<**##.##>", { vsk_ast(-2.3) });
+    vsk_scan_using_test_entry(__LINE__, "<**\\##.##>", { vsk_ast(+2.3) }, VSK_DIALECT_YEN);
+    vsk_scan_using_test_entry(__LINE__, "<$$##.##>", { vsk_ast(-2.3) }, VSK_DIALECT_DOLLAR);
+    vsk_scan_using_test_entry(__LINE__, "<##,###.##>[! @]", { vsk_ast(1234567.891), vsk_ast("XYZ"), vsk_ast("DEF") });
+    vsk_scan_using_test_entry(__LINE__, "<#.#->", { vsk_ast(-1.28) });
+    vsk_scan_using_test_entry(__LINE__, "<.#+>", { vsk_ast(-0.2) });
+    vsk_scan_using_test_entry(__LINE__, "<##.##^^^^>", { vsk_ast(-2.3) });
+    vsk_scan_using_test_entry(__LINE__, "<###.####^^^^>", { vsk_ast(3.9f) });
+    vsk_scan_using_test_entry(__LINE__, "<###.#^^^^>", { vsk_ast(1.5e-30) });
+    vsk_scan_using_test_entry(__LINE__, "_###_@ ##.# ", { vsk_ast(1.5), vsk_ast(12.25), vsk_ast(-3) });
+    vsk_scan_using_test_entry(__LINE__, "#", { vsk_ast(std::numeric_limits<VskDouble>::infinity()) });
+    vsk_scan_using_test_entry(__LINE__, " ##", { vsk_ast(INFINITY) });
+    vsk_scan_using_test_entry(__LINE__, " ##", { vsk_ast(-INFINITY) });
+    vsk_scan_using_test_entry(__LINE__, " ## ##", { vsk_ast(NAN), vsk_ast(12) });
+    vsk_scan_using_test_entry(__LINE__, " INF ##", { vsk_ast(12) });
+
+    VskScanner scanner;
+    VskScanField fields[4];
+    size_t count;
+    scanner.compile("<#####>");
+    assert(scanner.scan_line("< 1234>", 7, fields, 4, count) && count == 1);
+    assert(fields[0].m_is_int && fields[0].m_int == 1234);
+    assert(scanner.scan_line("<%123456>", 9, fields, 4, count) && count == 1);
+    assert(fields[0].m_overflow && fields[0].m_int == 123456);
+    assert(!scanner.scan_line("<12 34>", 7, fields, 4, count));
+    scanner.compile("<##.##^^^^>");
+    assert(scanner.scan_line("< 8.0D+04>", 10, fields, 4, count) && count == 1);
+    assert(fields[0].m_is_double && !fields[0].m_is_int && fields[0].m_dbl == 80000);
+
+    // 2^53を超える整数も正確に読み取る
+    scanner.compile("####################");
+    assert(scanner.scan_line(" 1234567890123456789", 20, fields, 4, count) && count == 1);
+    assert(fields[0].m_is_int && fields[0].m_int == 1234567890123456789LL);
+    assert(scanner.scan_line("-9223372036854775808", 20, fields, 4, count));
+    assert(fields[0].m_is_int && fields[0].m_int == INT64_MIN);
+    assert(scanner.scan_line(" 9223372036854775808", 20, fields, 4, count));
+    assert(!fields[0].m_is_int && fields[0].m_dbl == 9223372036854775808.0);
+    scanner.compile("###.##");
+    assert(scanner.scan_line(" 12.00", 6, fields, 4, count) && fields[0].m_is_int && fields[0].m_int == 12);
+    assert(scanner.scan_line(" -0.50", 6, fields, 4, count) && !fields[0].m_is_int);
+
+    // 書式項目が繰り返されるので、1行の欄の個数に上限はない
+    {
+        VskString text;
+        for (int i = 0; i < 1000; ++i)
+            text += " 12.50";
+        text += "\n";
+        size_t num_lines = 0;
+        vsk_scan_text(scanner, text.data(), text.size(),
+            [&](size_t line_no, const VskScanField *fields, size_t count, bool complete) {
+                assert(line_no == 1 && complete && count == 1000 && fields[999].m_dbl == 12.5);
+                ++num_lines;
+            });
+        assert(num_lines == 1);
+    }
+
+    // 並列に読み取っても、行番号と欄は1スレッドで読み取るのと同じになる
+    {
+        VskString text;
+        for (int i = 0; text.size() < 100000; ++i) {
+            char buf[32];
+            if (i % 1000 == 7)
+                text += "bad\n";
+            else
+                text.append(buf, std::snprintf(buf, sizeof(buf), "%6.2f\r\n", (i % 9999) / 100.0));
+        }
+        std::vector<VskString> outs(4);
+        VskString parallel, serial;
+        auto print = [](VskString& out, size_t line_no, const VskScanField *fields, size_t count, bool complete) {
+            char buf[64];
+            out.append(buf, std::snprintf(buf, sizeof(buf), "%u:%d:%u:%g\n", unsigned(line_no), complete,
+                                          unsigned(count), count ? fields[0].m_dbl : 0.0));
+        };
+        vsk_scan_text(scanner, text.data(), text.size(),
+            [&](size_t line_no, const VskScanField *fields, size_t count, bool complete) {
+                print(serial, line_no, fields, count, complete);
+            });
+        vsk_scan_text_parallel(scanner, text.data(), text.size(), 4,
+            [&](unsigned thread, size_t line_no, const VskScanField *fields, size_t count, bool complete) {
+                print(outs[thread], line_no, fields, count, complete);
+            },
+            [&](unsigned thread) {
+                parallel += outs[thread];
+                outs[thread].clear();
+            }, 4096);
+        assert(parallel == serial);
+    }
+}
+
+// カーネルの選択のテスト
+void vsk_kernel_test(void)
+{
+    static const struct {
+        const char *format;
+        VskKernel kernel;
+    } s_entries[] = {
+        { "###", VSK_KERNEL_INTEGER },
+        { "###.##", VSK_KERNEL_FIXED },
+        { ".#", VSK_KERNEL_FIXED },
+        { "#,###.##", VSK_KERNEL_COMMA },
+        { "**###.#", VSK_KERNEL_FILL },
+        { "$$#,###.##", VSK_KERNEL_FILL },
+        { "##.##^^^^", VSK_KERNEL_SCIENTIFIC },
+        { "+##.##", VSK_KERNEL_GENERIC },
+        { "**##-", VSK_KERNEL_GENERIC },
+        { "!", VSK_KERNEL_FIRSTCHAR },
+        { "&  &", VSK_KERNEL_PARTIALSTR },
+        { "@", VSK_KERNEL_WHOLESTR },
+        { "ABC", VSK_KERNEL_UNKNOWN },
+    };
+    static const VskDouble s_values[] = {
+        0, -0.0, 0.5, 1.5, -2.5, 0.125, 9.995, -99.995, 123456.789, 1e20, -1e-20,
+    };
+
+    for (auto& entry : s_entries) {
+        std::vector<VskFormatItem> items;
+        vsk_parse_formats(items, entry.format, VSK_DIALECT_DOLLAR);
+        assert(items.size() == 1);
+        assert(items[0].m_kernel == entry.kernel);
+        if (items[0].m_type != UT_NUMERIC)
+            continue;
+        // 特化したカーネルは汎用のカーネルと同じ結果になる
+        for (auto value : s_values) {
+            VskString out0, out1;
+            {
+                VskStringWriter writer0(out0), writer1(out1);
+                items[0].write_numeric(writer0, value, true);
+                s_vsk_kernels[VSK_KERNEL_GENERIC].m_numeric(items[0], writer1, value, true);
+            }
+            assert(out0 == out1);
+        }
+    }
+}
+
+// 数値書式の結果のメモのテスト
+void vsk_memo_test(void)
+{
+    std::vector<VskFormatItem> items;
+    vsk_parse_formats(items, "[##,###.##-]", VSK_DIALECT_DOLLAR);
+    VskFormatItem item = items[0];
+    assert(item.enable_memo());
+    auto format_memo = [](VskFormatItem& item, VskDouble d, bool is_double) {
+        VskString out;
+        {
+            VskStringWriter writer(out);
+            item.write_numeric_memo(writer, d, is_double);
+        }
+        return out;
+    };
+
+    // 同じ値は同じ結果になり、2回目からはヒットする
+    static const VskDouble s_values[] = { 0, -0.0, 1.5, -2.5, 9.995, 1234.5, 1e20, NAN };
+    for (int pass = 0; pass < 3; ++pass) {
+        for (auto value : s_values) {
+            for (bool is_double : { false, true })
+                assert(format_memo(item, value, is_double) == items[0].format_numeric(value, is_double));
+        }
+    }
+    assert(item.m_memo->m_hits > 0 && item.m_memo->m_misses > 0);
+
+    // コピーとはメモを共有しない
+    VskFormatItem copy = item;
+    assert(copy.m_memo && copy.m_memo.m_ptr != item.m_memo.m_ptr && copy.m_memo->m_hits == 0);
+    assert(format_memo(copy, 1.5, true) == format_memo(item, 1.5, true));
+
+    // constの書式項目はメモを使わない
+    const auto hits = item.m_memo->m_hits;
+    assert(item.format_numeric(1.5, true) == items[0].format_numeric(1.5, true) && item.m_memo->m_hits == hits);
+
+    // 長すぎる欄には使わない
+    vsk_parse_formats(items, "##########################.##", VSK_DIALECT_DOLLAR);
+    assert(!items[0].enable_memo());
+    vsk_parse_formats(items, "!");
+    assert(!items[0].enable_memo());
+
+    // ヒット率が低ければ迂回する
+    vsk_parse_formats(items, "#######", VSK_DIALECT_DOLLAR);
+    item = items[0];
+    item.enable_memo();
+    for (uint32_t i = 0; i < VskFormatMemo::s_window + 10; ++i)
+        assert(format_memo(item, i, true) == items[0].format_numeric(i, true));
+    assert(item.m_memo->m_bypassed == 10);
+}
+
+// バイナリレコードの整形のテスト
+void vsk_record_test(void)
+{
+    VskRecordLayout layout;
+    assert(layout.parse("i32,f64@8,c6") && layout.m_record_size == 22 && layout.m_fields.size() == 3);
+    assert(layout.m_fields[1].m_offset == 8 && layout.m_fields[2].m_offset == 16);
+    assert(layout.parse("i64@8,f32@0/24") && layout.m_record_size == 24);
+    assert(!layout.parse("") && !layout.parse("x32") && !layout.parse("i32@") && !layout.parse("i32@4/4"));
+    // 位置やサイズが大きすぎれば失敗する（あふれない）
+    assert(!layout.parse("i32@18446744073709551615") && !layout.parse("c18446744073709551615"));
+    assert(!layout.parse("i64@1048570") && !layout.parse("i32/1048577") && !layout.parse("c1048577"));
+    assert(layout.parse("i32@1048572") && layout.m_record_size == VskRecordLayout::s_max_size);
+
+    struct Record {
+        int32_t id;
+        double price;
+        char name[6];
+        float rate;
+        int64_t total;
+    };
+    static const Record s_records[] = {
+        { 1, 1234.5, "APPLE", 0.125f, 10000000000LL },
+        { -23, -0.005, { 'B', 'A', 'N', 'A', 'N', 'A' }, 2.5e-7f, -1 },
+    };
+    char text[128];
+    std::snprintf(text, sizeof(text), "i32@%u,f64@%u,c6@%u,f32@%u,i64@%u/%u",
+                  unsigned(offsetof(Record, id)), unsigned(offsetof(Record, price)),
+                  unsigned(offsetof(Record, name)), unsigned(offsetof(Record, rate)),
+                  unsigned(offsetof(Record, total)), unsigned(sizeof(Record)));
+    assert(layout.parse(text));
+
+    const char *format = "### $$#,###.## [&  &] #.##^^^^ ##.#^^^^";
+    VskRecordFormatter formatter;
+    assert(formatter.compile(format, layout, VSK_DIALECT_DOLLAR));
+    VskString out;
+    {
+        VskStringWriter writer(out);
+        formatter.write_records(writer, s_records, 2);
+    }
+    VskString expected, line;
+    for (auto& record : s_records) {
+        auto nul = static_cast<const char *>(std::memchr(record.name, 0, sizeof(record.name)));
+        VskString name(record.name, nul ? size_t(nul - record.name) : sizeof(record.name));
+        vsk_print_using(line, format, { vsk_ast(int(record.id)), vsk_ast(record.price), vsk_ast(name),
+                                        vsk_ast(record.rate), vsk_ast(VskDouble(record.total)) },
+                        VSK_DIALECT_DOLLAR);
+        expected += line + "\n";
+    }
+    assert(out == expected);
+
+    // メモを使っても同じ結果になる
+    VskRecordFormatter memo_formatter;
+    assert(memo_formatter.compile(format, layout, VSK_DIALECT_DOLLAR, true));
+    assert(memo_formatter.m_items[0].m_memo && !memo_formatter.m_items[2].m_memo);
+    VskString memo_out;
+    {
+        VskStringWriter writer(memo_out);
+        for (int i = 0; i < 3; ++i)
+            memo_formatter.write_records(writer, s_records, 2);
+    }
+    assert(memo_out == expected + expected + expected);
+
+    // 欄の型が書式項目と合わなければ失敗する
+    assert(!formatter.compile("& ###", layout, VSK_DIALECT_DOLLAR));
+}
+
+// 集約出力のテスト
+struct VskGatherTestSink {
+    VskString       m_out;                          // 出力
+    const char *    m_lower;                        // 参照されるべきテキストの範囲
+    const char *    m_upper;
+    int             m_literals = 0;                 // 範囲内を指したiovecの個数
+};
+static int vsk_gather_test_sink(void *context, PRINT_USING_IOVEC *iov, int count)
+{
+    auto sink = static_cast<VskGatherTestSink *>(context);
+    for (int i = 0; i < count; ++i) {
+        auto base = static_cast<const char *>(iov[i].iov_base);
+        if (sink->m_lower <= base && base < sink->m_upper)
+            ++sink->m_literals;
+        sink->m_out.append(base, iov[i].iov_len);
+    }
+    return 1;
+}
+void vsk_gather_test(void)
+{
+    std::vector<VskFormatItem> items;
+    // 長いテキストは参照し、短いテキストはコピーする
+    const VskString rule(VskGatherWriter::s_min_literal, '-');
+    vsk_parse_formats(items, "<<Name>> @ " + rule + " $$#,###.## <<Flag>> ! <<End>>", VSK_DIALECT_DOLLAR);
+    VskAstList args;
+    VskString long_str(40000, 'X');
+    for (int i = 0; i < 2000; ++i) {
+        args.push_back(vsk_ast(VskString((i == 50) ? long_str : "ITEM")));
+        args.push_back(vsk_ast(i * 12.5));
+        args.push_back(vsk_ast(VskString((i & 1) ? "" : "YES")));
+    }
+
+    VskString expected;
+    {
+        VskStringWriter writer(expected);
+        vsk_print_using(writer, items, args);
+    }
+
+    VskGatherTestSink sink;
+    sink.m_lower = items[0].m_post_literal.data();
+    sink.m_upper = sink.m_lower + items[0].m_post_literal.size();
+    {
+        VskGatherWriter writer(vsk_gather_test_sink, &sink);
+        vsk_print_using(writer, items, args);
+    }
+    assert(sink.m_out == expected);
+    assert(sink.m_literals == 2000);
+
+    // ファイル記述子に書き込む
+    FILE *fp = std::tmpfile();
+    assert(fp);
+#ifdef _WIN32
+    int fd = ::_fileno(fp);
 #else
-    vsk_print_using_test_entry(__LINE__, "<$$###._->", { vsk_ast(123.456) }, "< $123.->");
+    int fd = ::fileno(fp);
 #endif
+    {
+        VskGatherWriter writer(print_using_fd_iov_sink, &fd);
+        vsk_print_using(writer, items, args);
+        writer.flush();
+        assert(!writer.m_failed);
+    }
+    VskString written(expected.size() + 1, '\0');
+    std::rewind(fp);
+    written.resize(std::fread(&written[0], 1, written.size(), fp));
+    std::fclose(fp);
+    assert(written == expected);
+}
 
-    if (s_failure)
-        std::printf("FAILED: %d\n", s_failure);
+// C言語の関数のテスト（書式項目を持たずに直接バッファーに書き込む）
+void vsk_sprint_using_test(void)
+{
+    static const char *s_formats[] = {
+        "##", "###.##", "+##.#", "##.#-", "##.##+", "**#,###", "$$#.##", "**$##.##",
+        "#.##^^^^", "+##.##^^^^", "<_#_#> ##", "_", "ABC _! ###",
+    };
+    static const VskDouble s_values[] = {
+        0, -0.0, 1.5, -2.5, 9.995, 123456.789, 1e20, -1e-20, NAN, -INFINITY,
+    };
+    char buf[256];
+    for (auto format : s_formats) {
+        for (auto value : s_values) {
+            VskString expected;
+            vsk_print_using(expected, format, { vsk_ast(value) }, VSK_DIALECT_DOLLAR);
+            sprint_using_dialect(PRINT_USING_DIALECT_DOLLAR, buf, sizeof(buf), format, value);
+            assert(expected == buf);
+        }
+    }
+
+    sprint_using_dialect(PRINT_USING_DIALECT_YEN, buf, sizeof(buf), "[&  &]!@ ##", "ABCDEF", "X", "YZ", 12.0);
+    assert(std::strcmp(buf, "[ABCD]XYZ 12") == 0);
+
+    // あふれた分は捨てる
+    sprint_using(buf, 5, "###.##", 123.456);
+    assert(std::strcmp(buf, "123.") == 0);
+    buf[0] = 'X';
+    sprint_using(buf, 1, "###.##", 123.456);
+    assert(buf[0] == 0);
+}
+
+// コンパイル済みの書式項目のテスト
+static void vsk_format_test_sink(void *context, const char *data, size_t len)
+{
+    static_cast<VskString *>(context)->append(data, len);
+}
+void vsk_format_test(void)
+{
+    PRINT_USING_ITEM item;
+    assert(!print_using_compile_item(&item, PRINT_USING_DIALECT_DOLLAR, "", 0));
+    assert(!print_using_compile_item(&item, PRINT_USING_DIALECT_DOLLAR, "ABC", 3));
+    assert(!print_using_compile_item(&item, PRINT_USING_DIALECT_DOLLAR, "## ##", 5));
+
+    static const char *s_formats[] = { "<##,###.##>", "**$#.##", "_##.#^^^^_", "[&  &]" };
+    for (auto format : s_formats) {
+        assert(print_using_compile_item(&item, PRINT_USING_DIALECT_DOLLAR, format, std::strlen(format)));
+        for (VskDouble value : { 0.0, -1234.567, 1e10, VskDouble(NAN) }) {
+            VskString out;
+            char buf[64];
+            if (item.numeric) {
+                print_using_format_number(&item, value, 1, vsk_format_test_sink, &out);
+                sprint_using_dialect(PRINT_USING_DIALECT_DOLLAR, buf, sizeof(buf), format, value);
+            } else {
+                print_using_format_string(&item, "ABCDEF", 6, vsk_format_test_sink, &out);
+                sprint_using_dialect(PRINT_USING_DIALECT_DOLLAR, buf, sizeof(buf), format, "ABCDEF");
+            }
+            assert(out == buf);
+        }
+    }
+
+#ifdef PRINT_USING_FMT
+    assert(fmt::format("{:pu(##,###.##)}", print_using_arg(1234.5)) == " 1,234.50");
+    assert(fmt::format("[{:pu(#.#^^^^)}|{:pu(&  &)}]", print_using_arg(12.0), print_using_arg("ABCDEF")) ==
+           "[0.1D+02|ABCD]");
+    assert(fmt::format("{:pu(#.##^^^^)}", print_using_arg(1.5f)) == "0.15E+01");
+    assert(fmt::format("{:pu(_{##_})}", print_using_arg(7)) == "{ 7}");
+    // 方言を指定する
+    assert(fmt::format("{:pu$(**$#.##)}", print_using_arg(1.5)) == "**$1.50");
+    assert(fmt::format("{:pu\\(**\\#.##)}", print_using_arg(1.5)) == "**\\1.50");
+    bool thrown = false;
+    try {
+        (void)fmt::format(fmt::runtime("{:pu(!)}"), print_using_arg(1));
+    } catch (const fmt::format_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+    thrown = false;
+    try {
+        (void)fmt::format(fmt::runtime("{:pu#(##)}"), print_using_arg(1));
+    } catch (const fmt::format_error&) {
+        thrown = true;
+    }
+    assert(thrown);
+#endif
+#if defined(__cpp_lib_format) && defined(PRINT_USING_STD_FORMAT)
+    assert(std::format("{:pu(##,###.##)}", print_using_arg(1234.5)) == " 1,234.50");
+    assert(std::format("{:pu$(**$#.##)}", print_using_arg(1.5)) == "**$1.50");
+    assert(std::format("[{:pu(!)}]", print_using_arg(std::string_view("XYZ"))) == "[X]");
+#endif
+
+    // 出力の読み取り
+    PRINT_USING_SCANNER *scanner = print_using_scanner_compile(PRINT_USING_DIALECT_DOLLAR, "[##.##] @ ##");
+    assert(scanner);
+    PRINT_USING_SCAN_FIELD fields[3];
+    size_t count;
+    const char *line = "[12.50] APPLE %123";
+    assert(print_using_scan_line(scanner, line, std::strlen(line), fields, 3, &count) && count == 3);
+    assert(fields[0].numeric && !fields[0].is_int && fields[0].value == 12.5 && !fields[0].overflow);
+    assert(!fields[1].numeric && fields[1].len == 5 && std::memcmp(fields[1].str, "APPLE", 5) == 0);
+    assert(fields[2].numeric && fields[2].is_int && fields[2].int_value == 123 && fields[2].overflow);
+    assert(!print_using_scan_line(scanner, "[1.00]", 6, fields, 3, &count) && count == 0);
+    print_using_scanner_free(scanner);
+
+    // バイナリレコードの整形
+    struct Record { int32_t id; char name[4]; double price; };
+    static const Record s_records[] = { { 1, { 'A', 'B' }, 12.5 }, { -2, { 'W', 'X', 'Y', 'Z' }, 1e6 } };
+    char layout[64];
+    std::snprintf(layout, sizeof(layout), "i32@%u,c4@%u,f64@%u/%u",
+                  unsigned(offsetof(Record, id)), unsigned(offsetof(Record, name)),
+                  unsigned(offsetof(Record, price)), unsigned(sizeof(Record)));
+    assert(!print_using_records_compile(PRINT_USING_DIALECT_DOLLAR, "& ##", layout, 0)); // Type mismatch
+    assert(!print_using_records_compile(PRINT_USING_DIALECT_DOLLAR, "##", "i32@18446744073709551615", 0));
+    for (int flags = 0; flags <= PRINT_USING_RECORDS_MEMO; ++flags) {
+        PRINT_USING_RECORDS *records =
+            print_using_records_compile(PRINT_USING_DIALECT_DOLLAR, "## [&  &] $$#,###.##", layout, flags);
+        assert(records && print_using_records_size(records) == sizeof(Record));
+        VskString out;
+        print_using_records_format(records, s_records, 2, vsk_format_test_sink, &out);
+        print_using_records_free(records);
+        assert(out == " 1 [AB  ]     $12.50\n-2 [WXYZ] %$1,000,000.00\n");
+
+        // iovecの出力先でも同じになる
+        records = print_using_records_compile(PRINT_USING_DIALECT_DOLLAR, "## [&  &] $$#,###.##", layout, flags);
+        VskGatherTestSink sink;
+        sink.m_lower = sink.m_upper = nullptr;
+        assert(print_using_records_format_iov(records, s_records, 2, vsk_gather_test_sink, &sink));
+        assert(sink.m_out == out);
+        FILE *fp = std::tmpfile();
+        assert(fp);
+#ifdef _WIN32
+        int fd = ::_fileno(fp);
+#else
+        int fd = ::fileno(fp);
+#endif
+        assert(print_using_records_format_iov(records, s_records, 2, print_using_fd_iov_sink, &fd));
+        VskString written(out.size() + 1, '\0');
+        std::rewind(fp);
+        written.resize(std::fread(&written[0], 1, written.size(), fp));
+        std::fclose(fp);
+        assert(written == out);
+        int bad_fd = -1;
+        assert(!print_using_records_format_iov(records, s_records, 2, print_using_fd_iov_sink, &bad_fd));
+        print_using_records_free(records);
+    }
 }
 
-#endif // ndef NDEBUG
+// 遅延ログのテスト
+void vsk_log_test(void)
+{
+    int id0 = vsk_log_register("<##.##> & &", VSK_DIALECT_DOLLAR);
+    int id1 = vsk_log_register("[$$#,###]_@", VSK_DIALECT_DOLLAR);
+    assert(id0 >= 0 && id1 == id0 + 1);
+    assert(vsk_log_register("") == -1);
+    assert(!print_using_log(id0, 1.0, "X")); // 開いていない
+
+    for (int binary = 0; binary <= 1; ++binary) {
+        FILE *fp = std::tmpfile();
+        assert(fp);
+        bool ok = vsk_log_open(fp, binary != 0);
+        assert(ok);
+        assert(!vsk_log_open(fp, binary != 0)); // 既に開いている
+        assert(print_using_log(id0, 2.3, "ABCDEF"));
+        std::thread thread([&]() {
+            assert(print_using_log(id1, 1234.0));
+        });
+        thread.join();
+        assert(print_using_log(id0, -2.3, "Z"));
+        assert(!print_using_log(id1 + 1, 0.0));
+        vsk_log_close();
+
+        // 出力を読む
+        std::rewind(fp);
+        VskString text;
+        if (binary) {
+            VskStringWriter writer(text);
+            ok = vsk_log_decode(fp, writer);
+            assert(ok);
+        } else {
+            char buf[256];
+            size_t len;
+            while ((len = std::fread(buf, 1, sizeof(buf), fp)) > 0)
+                text.append(buf, len);
+        }
+        std::fclose(fp);
+
+        // スレッドごとに順序が保たれる
+        assert(text.find("< 2.30> ABC\n") != VskString::npos);
+        assert(text.find("< 2.30> ABC\n") < text.find("<-2.30> Z  \n"));
+        assert(text.find("[ $1,234]@\n") != VskString::npos);
+        assert(text.size() == 12 + 12 + 11);
+    }
 
-#ifdef PRINT_USING_EXE
-int main(int argc, char **argv)
+    // 数値だけのレコードでリングバッファーをあふれさせる。
+    // 入りきらないレコードは捨てられて数えられ、途中までのレコードは残らない
+    int id2 = vsk_log_register("[## ## ## ## ## ## ## ##]", VSK_DIALECT_DOLLAR);
+    for (int binary = 0; binary <= 1; ++binary) {
+        FILE *fp = std::tmpfile();
+        assert(fp && vsk_log_open(fp, binary != 0));
+        const size_t count = 200000;
+        size_t logged = 0;
+        for (size_t i = 0; i < count; ++i)
+            logged += print_using_log(id2, 1.0, 2.0, 3.0, 4.0, 5.0, 6.0, 7.0, 8.0);
+        const size_t dropped = print_using_log_dropped();
+        vsk_log_close();
+        assert(logged + dropped == count);
+
+        std::rewind(fp);
+        VskString text;
+        {
+            VskStringWriter writer(text);
+            if (binary) {
+                bool ok = vsk_log_decode(fp, writer);
+                assert(ok);
+            } else {
+                char buf[4096];
+                size_t len;
+                while ((len = std::fread(buf, 1, sizeof(buf), fp)) > 0)
+                    writer.put(buf, len);
+            }
+        }
+        std::fclose(fp);
+        const VskString line = "[ 1  2  3  4  5  6  7  8]\n";
+        assert(text.size() == logged * line.size());
+        for (size_t i = 0; i < text.size(); i += line.size())
+            assert(text.compare(i, line.size(), line) == 0);
+    }
+
+    // 終わったスレッドのリングバッファーは解放される
+    {
+        FILE *fp = std::tmpfile();
+        assert(fp && vsk_log_open(fp, false));
+        for (int i = 0; i < 50; ++i) {
+            std::thread thread([&]() {
+                assert(print_using_log(id0, 1.0, "A"));
+            });
+            thread.join();
+        }
+        size_t num_rings = 50;
+        for (int i = 0; i < 1000 && num_rings > 0; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            std::lock_guard<std::mutex> lock(s_vsk_logger.m_mutex);
+            num_rings = s_vsk_logger.m_rings.size();
+        }
+        assert(num_rings == 0);
+        vsk_log_close();
+        assert(std::ftell(fp) == 50 * 12);
+        std::fclose(fp);
+    }
+
+    // 壊れたバイナリーログは、大きなバッファーを確保せずに失敗する
+    static const struct { char tag; uint32_t len; uint8_t dialect; bool ok; } s_corrupt[] = {
+        { 'F', 5, VSK_DIALECT_DOLLAR, true },
+        { 'F', 5, 7, false },                                       // 不正な方言
+        { 'F', uint32_t(s_vsk_log_max_format + 1), VSK_DIALECT_YEN, false },
+        { 'R', 0xFFFFFFFF, 0, false },                              // リングバッファーより大きい
+    };
+    for (auto& entry : s_corrupt) {
+        FILE *fp = std::tmpfile();
+        assert(fp);
+        const uint32_t id = 0;
+        std::fwrite(s_vsk_log_signature, sizeof(s_vsk_log_signature), 1, fp);
+        std::fwrite(&s_vsk_log_version, sizeof(s_vsk_log_version), 1, fp);
+        std::fputc(entry.tag, fp);
+        std::fwrite(&id, sizeof(id), 1, fp);
+        if (entry.tag == 'F')
+            std::fwrite(&entry.dialect, sizeof(entry.dialect), 1, fp);
+        std::fwrite(&entry.len, sizeof(entry.len), 1, fp);
+        std::fputs("#.## ", fp);
+        std::rewind(fp);
+        VskString text;
+        VskStringWriter writer(text);
+        assert(vsk_log_decode(fp, writer) == entry.ok);
+        std::fclose(fp);
+    }
+}
+
+
+#ifndef PRINT_USING_EXE
+int main(void)
 {
-#ifndef NDEBUG
     vsk_add_commas_test();
     vsk_parse_formats_test();
     vsk_print_using_test();
+    vsk_scan_using_test();
+    vsk_kernel_test();
+    vsk_memo_test();
+    vsk_record_test();
+    vsk_gather_test();
+    vsk_sprint_using_test();
+    vsk_format_test();
+    vsk_log_test();
+    if (s_failure) {
+        std::printf("FAILED: %d\n", s_failure);
+        return 1;
+    }
+    std::printf("OK\n");
+    return 0;
+}
+#endif
+#endif // def PRINT_USING_TEST
+
+#ifdef PRINT_USING_EXE
+// PRINT USING文の出力ファイルを読み取り、欄をタブ区切りで出力する
+static int vsk_scan_main(const char *format, const char *filename, VskDialect dialect)
+{
+    VskScanner scanner;
+    if (!scanner.compile(format, dialect)) {
+        std::fprintf(stderr, "Illegal function call\n");
+        return 1;
+    }
+
+    // 塊ごとに並列に読み取り、スレッドごとの出力を塊の順番に書き出す
+    unsigned num_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<VskString> outs(num_threads), errors(num_threads);
+    std::vector<int> mismatches(num_threads);
+    int failures = 0;
+    bool ok = vsk_scan_file_parallel(scanner, filename, num_threads,
+        [&](unsigned thread, size_t line_no, const VskScanField *fields, size_t count, bool complete) {
+            VskString& out = outs[thread];
+            char buf[64];
+            if (!complete) {
+                std::snprintf(buf, sizeof(buf), ":%u: format mismatch\n", unsigned(line_no));
+                errors[thread] += filename;
+                errors[thread] += buf;
+                ++mismatches[thread];
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (i) out += '\t';
+                auto& field = fields[i];
+                if (field.m_type == UT_NUMERIC) {
+                    if (field.m_is_int)
+                        out.append(buf, std::snprintf(buf, sizeof(buf), "%lld", (long long)field.m_int));
+                    else
+                        out.append(buf, std::snprintf(buf, sizeof(buf), "%.15g", field.m_dbl));
+                } else {
+                    out.append(field.m_str, field.m_len);
+                }
+            }
+            out += '\n';
+        },
+        [&](unsigned thread) {
+            if (mismatches[thread]) {
+                std::fflush(stdout);
+                std::fputs(errors[thread].c_str(), stderr);
+                failures += mismatches[thread];
+                mismatches[thread] = 0;
+                errors[thread].clear();
+            }
+            std::fwrite(outs[thread].data(), 1, outs[thread].size(), stdout);
+            outs[thread].clear();
+        });
+    if (!ok) {
+        std::fprintf(stderr, "%s: cannot open\n", filename);
+        return 1;
+    }
+    return failures ? 1 : 0;
+}
+
+// バイナリレコードのファイルを整形して出力する
+static int vsk_records_main(const char *format, const char *layout_text, const char *filename,
+                            VskDialect dialect, bool memo)
+{
+    VskRecordLayout layout;
+    if (!layout.parse(layout_text)) {
+        std::fprintf(stderr, "%s: invalid layout\n", layout_text);
+        return 1;
+    }
+    VskRecordFormatter formatter;
+    if (!formatter.compile(format, layout, dialect, memo)) {
+        std::fprintf(stderr, "Type mismatch\n");
+        return 1;
+    }
+
+    // 前後のテキストはコピーせずにwritevで書き込む
+    size_t remainder;
+    bool ok;
+    std::fflush(stdout);
+#ifdef _WIN32
+    int fd = ::_fileno(stdout);
+#else
+    int fd = ::fileno(stdout);
 #endif
+    {
+        VskGatherWriter writer(print_using_fd_iov_sink, &fd);
+        ok = vsk_render_file(formatter, filename, writer, remainder);
+        writer.flush();
+        if (writer.m_failed) {
+            std::fprintf(stderr, "write error\n");
+            return 1;
+        }
+    }
+    if (!ok) {
+        std::fprintf(stderr, "%s: cannot open\n", filename);
+        return 1;
+    }
+    if (remainder) {
+        std::fprintf(stderr, "%s: %u trailing bytes\n", filename, unsigned(remainder));
+        return 1;
+    }
+    return 0;
+}
+
+// バイナリーログを整形して出力する
+static int vsk_decode_main(const char *filename)
+{
+    FILE *fp = std::fopen(filename, "rb");
+    if (!fp) {
+        std::fprintf(stderr, "%s: cannot open\n", filename);
+        return 1;
+    }
+    bool ok;
+    {
+        VskFileWriter writer(stdout);
+        ok = vsk_log_decode(fp, writer);
+    }
+    std::fclose(fp);
+    if (!ok) {
+        std::fprintf(stderr, "%s: invalid log\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+// ベンチマーク用の時計（ナノ秒）
+static double vsk_bench_now(void)
+{
+    using namespace std::chrono;
+    return double(duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+}
+
+// カーネルごとのベンチマーク
+static int vsk_bench_kernels(void)
+{
+    static const struct {
+        const char *format;
+        VskDialect dialect;
+    } s_formats[] = {
+        { "#####", VSK_DIALECT_DEFAULT },
+        { "####.##", VSK_DIALECT_DEFAULT },
+        { "##,###.##", VSK_DIALECT_DEFAULT },
+        { "**\\##,###.##", VSK_DIALECT_YEN },
+        { "$$####.##", VSK_DIALECT_DOLLAR },
+        { "##.##^^^^", VSK_DIALECT_DEFAULT },
+        { "+####.##", VSK_DIALECT_DEFAULT },
+        { "!", VSK_DIALECT_DEFAULT },
+        { "&      &", VSK_DIALECT_DEFAULT },
+        { "@", VSK_DIALECT_DEFAULT },
+    };
+    const int count = 2000000;
+
+    // 値を用意する
+    VskDouble values[1024];
+    unsigned seed = 1;
+    for (auto& value : values) {
+        seed = seed * 1103515245 + 12345;
+        value = (int(seed >> 8) % 2000000 - 1000000) / 100.0;
+    }
+
+    char buf[512];
+    VskWriter writer(buf, sizeof(buf));
+    std::printf("%-16s %-12s %12s %12s\n", "format", "kernel", "ns/value", "generic");
+    for (auto& entry : s_formats) {
+        std::vector<VskFormatItem> items;
+        vsk_parse_formats(items, entry.format, entry.dialect);
+        const VskFormatItem& item = items[0];
+
+        double t0 = vsk_bench_now();
+        for (int i = 0; i < count; ++i) {
+            writer.m_len = 0;
+            if (item.m_type == UT_NUMERIC)
+                item.write_numeric(writer, values[i & 1023], true);
+            else
+                item.write_string(writer, "ABCDEFGHIJ", 10);
+        }
+        double t1 = vsk_bench_now();
+        if (item.m_type != UT_NUMERIC) {
+            std::printf("%-16s %-12s %12.1f %12s\n", entry.format, s_vsk_kernels[item.m_kernel].m_name,
+                        (t1 - t0) / count, "-");
+            continue;
+        }
+        for (int i = 0; i < count; ++i) {
+            writer.m_len = 0;
+            s_vsk_kernels[VSK_KERNEL_GENERIC].m_numeric(item, writer, values[i & 1023], true);
+        }
+        double t2 = vsk_bench_now();
+        std::printf("%-16s %-12s %12.1f %12.1f\n", entry.format, s_vsk_kernels[item.m_kernel].m_name,
+                    (t1 - t0) / count, (t2 - t1) / count);
+    }
+    return 0;
+}
+
+// 数値書式の結果のメモのベンチマーク
+static int vsk_bench_memo(void)
+{
+    static const char *s_formats[] = { "##,###.##", "**$#,###.##", "##.##^^^^" };
+    const int count = 2000000;
+
+    std::printf("%-16s %12s %12s %12s %12s\n", "format", "distinct", "ns/value", "memo", "hit rate");
+    for (auto format : s_formats) {
+        for (unsigned distinct : { 16u, 200u, 1000000u }) {
+            // 値を用意する
+            std::vector<VskDouble> values(65536);
+            unsigned seed = 1;
+            for (auto& value : values) {
+                seed = seed * 1103515245 + 12345;
+                value = int((seed >> 8) % distinct) * 0.25;
+            }
+
+            std::vector<VskFormatItem> items;
+            vsk_parse_formats(items, format, VSK_DIALECT_DOLLAR);
+            VskFormatItem item = items[0];
+            item.enable_memo();
+
+            char buf[512];
+            VskWriter writer(buf, sizeof(buf));
+            double t0 = vsk_bench_now();
+            for (int i = 0; i < count; ++i) {
+                writer.m_len = 0;
+                items[0].write_numeric(writer, values[i & 65535], true);
+            }
+            double t1 = vsk_bench_now();
+            for (int i = 0; i < count; ++i) {
+                writer.m_len = 0;
+                item.write_numeric_memo(writer, values[i & 65535], true);
+            }
+            double t2 = vsk_bench_now();
+            std::printf("%-16s %12u %12.1f %12.1f %11.1f%%\n", format, distinct,
+                        (t1 - t0) / count, (t2 - t1) / count, item.m_memo->hit_rate() * 100);
+        }
+    }
+    return 0;
+}
+
+// 書式の解析のベンチマーク
+static int vsk_bench_parse(void)
+{
+    static const char s_piece[] = "Name: &          &  Qty: ##,###  Price: **$#,###.##  Rate: ##.##^^^^ _#\n";
+    std::printf("%-16s %12s %12s %12s\n", "format size", "items", "tokenize", "parse");
+    for (size_t size : { 4 * 1024, 64 * 1024, 1024 * 1024 }) {
+        VskString format;
+        while (format.size() < size)
+            format += s_piece;
+        const int count = int(64 * 1024 * 1024 / format.size());
+
+        size_t num_items = 0;
+        double t0 = vsk_bench_now();
+        for (int i = 0; i < count; ++i) {
+            VskFormatTokenizer<VskDialectDollar> tokenizer(format.data(), format.size());
+            VskFormatToken token;
+            while (tokenizer.next(token))
+                ++num_items;
+        }
+        double t1 = vsk_bench_now();
+        std::vector<VskFormatItem> items;
+        for (int i = 0; i < count; ++i)
+            vsk_parse_formats(items, format, VSK_DIALECT_DOLLAR);
+        double t2 = vsk_bench_now();
+
+        const double mb = double(format.size()) * count / (1024 * 1024);
+        std::printf("%-16u %12u %9.1f MB/s %7.1f MB/s\n", unsigned(format.size()), unsigned(num_items / count),
+                    mb / ((t1 - t0) * 1e-9), mb / ((t2 - t1) * 1e-9));
+    }
+    return 0;
+}
+
+// 出力の読み取りの速さを測る（1スレッドと全スレッド）
+static int vsk_bench_scan(void)
+{
+    const char *format = "Name: &      &  Qty: ##,###  Price: $$#,###.##  Code: @";
+    std::vector<VskFormatItem> items;
+    vsk_parse_formats(items, format, VSK_DIALECT_DOLLAR);
+    VskString text, line;
+    for (int i = 0; text.size() < 64 * 1024 * 1024; ++i) {
+        vsk_print_using(line, format, { vsk_ast("ITEM" + std::to_string(i % 97)), vsk_ast(i % 50000),
+                                        vsk_ast(i * 0.25), vsk_ast("X" + std::to_string(i)) },
+                        VSK_DIALECT_DOLLAR);
+        text += line;
+        text += '\n';
+    }
+    VskScanner scanner;
+    scanner.compile(format, VSK_DIALECT_DOLLAR);
+
+    const unsigned max_threads = std::max(1u, std::thread::hardware_concurrency());
+    std::printf("%-16s %12s\n", "threads", "scan");
+    double base = 0;
+    for (unsigned num_threads : { 1u, max_threads }) {
+        std::vector<size_t> sums(num_threads);
+        double t0 = vsk_bench_now();
+        vsk_scan_text_parallel(scanner, text.data(), text.size(), num_threads,
+            [&](unsigned thread, size_t, const VskScanField *, size_t count, bool) { sums[thread] += count; },
+            [](unsigned) { });
+        double t1 = vsk_bench_now();
+        const double gb = double(text.size()) / (1024 * 1024 * 1024);
+        const double rate = gb / ((t1 - t0) * 1e-9);
+        if (!base)
+            base = rate;
+        std::printf("%-16u %7.2f GB/s (x%.2f)\n", num_threads, rate, rate / base);
+        if (max_threads == 1)
+            break;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    // 方言の指定があれば取り出す
+    VskDialect dialect = VSK_DIALECT_DEFAULT;
+    if (argc >= 2 && std::strcmp(argv[1], "--yen") == 0)
+    {
+        dialect = VSK_DIALECT_YEN;
+        ++argv;
+        --argc;
+    }
+    else if (argc >= 2 && std::strcmp(argv[1], "--dollar") == 0)
+    {
+        dialect = VSK_DIALECT_DOLLAR;
+        ++argv;
+        --argc;
+    }
+
+    if (argc == 4 && std::strcmp(argv[1], "--scan") == 0)
+        return vsk_scan_main(argv[2], argv[3], dialect);
+    if (argc == 5 && std::strcmp(argv[1], "--records") == 0)
+        return vsk_records_main(argv[2], argv[3], argv[4], dialect, false);
+    if (argc == 6 && std::strcmp(argv[1], "--records") == 0 && std::strcmp(argv[2], "--memo") == 0)
+        return vsk_records_main(argv[3], argv[4], argv[5], dialect, true);
+    if (argc == 3 && std::strcmp(argv[1], "--decode") == 0)
+        return vsk_decode_main(argv[2]);
+    if (argc == 2 && std::strcmp(argv[1], "--bench") == 0)
+        return vsk_bench_kernels() || vsk_bench_memo() || vsk_bench_parse() || vsk_bench_scan();
 
     if (argc < 3)
     {
         std::printf("print_using Version %u\n\n", PRINT_USING_VERSION);
-        std::printf("Usage: print_using format parameters\n");
+        std::printf("Usage: print_using [--yen | --dollar] format parameters\n");
+        std::printf("       print_using [--yen | --dollar] --scan format file\n");
+        std::printf("       print_using [--yen | --dollar] --records [--memo] format layout file\n");
+        std::printf("       print_using --decode binary_log\n");
+        std::printf("       print_using --bench\n");
         return 1;
     }
 
@@ -896,7 +3872,7 @@ int main(int argc, char **argv)
     }
 
     VskString out;
-    vsk_print_using(out, argv[1], args);
+    vsk_print_using(out, argv[1], args, dialect);
     std::puts(out.c_str());
 
     return 0;
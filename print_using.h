@@ -6,15 +6,261 @@
 
 #define PRINT_USING_VERSION 114
 
+#if !defined(PRINT_USING_MINIMAL) && !defined(_WIN32)
+    #include <sys/uio.h>
+#endif
+
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+// The dialect of PRINT USING (the currency symbol)
+typedef enum PRINT_USING_DIALECT {
+    PRINT_USING_DIALECT_DEFAULT = 0,    // Yen if built with JAPAN, otherwise Dollar
+    PRINT_USING_DIALECT_YEN,            // "\\\\" and "**\\" (Yen sign)
+    PRINT_USING_DIALECT_DOLLAR,         // "$$" and "**$" (Dollar sign)
+} PRINT_USING_DIALECT;
+
 int print_using(const char *format, ...);
 int vprint_using(const char *format, va_list va);
 void sprint_using(char *buffer, size_t buffer_size, const char *format, ...);
 void vsprint_using(char *buffer, size_t buffer_size, const char *format, va_list va);
 
+int print_using_dialect(PRINT_USING_DIALECT dialect, const char *format, ...);
+int vprint_using_dialect(PRINT_USING_DIALECT dialect, const char *format, va_list va);
+void sprint_using_dialect(PRINT_USING_DIALECT dialect, char *buffer, size_t buffer_size, const char *format, ...);
+void vsprint_using_dialect(PRINT_USING_DIALECT dialect, char *buffer, size_t buffer_size, const char *format, va_list va);
+
+// A single format item compiled by print_using_compile_item (used by the C++ formatters below).
+// pre and post point into the compiled format, which must outlive the item. They are the raw
+// format text; "_" escapes are resolved only when the item is formatted.
+typedef struct PRINT_USING_ITEM {
+    const char *pre;                    // Raw format text before the field
+    size_t pre_len;
+    const char *post;                   // Raw format text after the field
+    size_t post_len;
+    int numeric;                        // Nonzero if the item formats a number
+    union {
+        double align;
+        unsigned char data[32];         // Private to print_using.cpp
+    } spec;
+} PRINT_USING_ITEM;
+
+// Receives the formatted text in one or more pieces
+typedef void (*PRINT_USING_SINK)(void *context, const char *data, size_t len);
+
+int print_using_compile_item(PRINT_USING_ITEM *item, PRINT_USING_DIALECT dialect, const char *format, size_t len);
+void print_using_format_number(const PRINT_USING_ITEM *item, double value, int is_double,
+                               PRINT_USING_SINK sink, void *context);
+void print_using_format_string(const PRINT_USING_ITEM *item, const char *str, size_t len,
+                               PRINT_USING_SINK sink, void *context);
+
+#ifndef PRINT_USING_MINIMAL
+// Deferred logging: the caller only copies the arguments; formatting is done
+// by a background thread (text log) or later by "print_using --decode" (binary log).
+// Not available in the minimal build (PRINT_USING_MINIMAL).
+int print_using_log_open(const char *filename, int binary);
+int print_using_log_register(PRINT_USING_DIALECT dialect, const char *format);
+int print_using_log(int id, ...);
+int vprint_using_log(int id, va_list va);
+size_t print_using_log_dropped(void);
+void print_using_log_close(void);
+
+// Binary records: each record of the layout ("i32,f64@8,c6/24", see VskRecordLayout::parse)
+// is formatted as one line like "PRINT USING format; field1, field2, ...".
+// Not available in the minimal build (PRINT_USING_MINIMAL).
+typedef struct PRINT_USING_RECORDS PRINT_USING_RECORDS;
+#define PRINT_USING_RECORDS_MEMO 1      // Memoize numeric fields (updates the handle while formatting)
+PRINT_USING_RECORDS *print_using_records_compile(PRINT_USING_DIALECT dialect, const char *format,
+                                                 const char *layout, int flags);
+size_t print_using_records_size(const PRINT_USING_RECORDS *records);
+// Not thread-safe when compiled with PRINT_USING_RECORDS_MEMO: use one handle per thread.
+void print_using_records_format(PRINT_USING_RECORDS *records, const void *data, size_t count,
+                                PRINT_USING_SINK sink, void *context);
+void print_using_records_free(PRINT_USING_RECORDS *records);
+
+// Scatter-gather output: long literal text of the format is passed by reference into the
+// records handle instead of being copied, so the pieces are valid only during the sink call.
+#ifdef _WIN32
+typedef struct PRINT_USING_IOVEC {      // Same as POSIX struct iovec
+    void *iov_base;
+    size_t iov_len;
+} PRINT_USING_IOVEC;
+#else
+typedef struct iovec PRINT_USING_IOVEC;
+#endif
+// Receives the formatted text as a list of pieces. Returns zero on failure.
+typedef int (*PRINT_USING_IOV_SINK)(void *context, PRINT_USING_IOVEC *iov, int count);
+// A sink that writes the pieces to a file descriptor (context is an int *) with writev.
+int print_using_fd_iov_sink(void *context, PRINT_USING_IOVEC *iov, int count);
+// Like print_using_records_format, but through an iovec sink. Returns zero if the sink failed.
+int print_using_records_format_iov(PRINT_USING_RECORDS *records, const void *data, size_t count,
+                                   PRINT_USING_IOV_SINK sink, void *context);
+
+// Reading the output of PRINT USING back into fields (the reverse of formatting).
+// Not available in the minimal build (PRINT_USING_MINIMAL).
+typedef struct PRINT_USING_SCANNER PRINT_USING_SCANNER;
+typedef struct PRINT_USING_SCAN_FIELD {
+    const char *str;                    // Text of the field (points into the line)
+    size_t len;
+    double value;                       // Numeric value
+    long long int_value;                // Exact integer value if is_int is nonzero
+    int numeric;                        // Nonzero if the field is numeric
+    int is_int;                         // Nonzero if the value is an integer that fits in int_value
+    int is_double;                      // Nonzero if the exponent was "D"
+    int overflow;                       // Nonzero if the field overflowed ("%")
+} PRINT_USING_SCAN_FIELD;
+PRINT_USING_SCANNER *print_using_scanner_compile(PRINT_USING_DIALECT dialect, const char *format);
+// Returns nonzero if the whole line matched. *count receives the number of fields read.
+int print_using_scan_line(const PRINT_USING_SCANNER *scanner, const char *line, size_t len,
+                          PRINT_USING_SCAN_FIELD *fields, size_t max_fields, size_t *count);
+void print_using_scanner_free(PRINT_USING_SCANNER *scanner);
+#endif
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
+
+// std::format / fmt::format support (C++17 or later; define PRINT_USING_FMT for fmt):
+//     fmt::format("{:pu(##,###.##)}", print_using_arg(x))
+// "pu(" uses the default dialect; "pu$(" selects the Dollar dialect and "pu\\(" the Yen dialect.
+// The format item is compiled once in parse() and written straight into the output iterator.
+// The std::formatter is held back until PRINT_USING_STD_FORMAT is defined (C++20 <format> required).
+#if defined(__cplusplus) && __cplusplus >= 201703L && !defined(PRINT_USING_MINIMAL)
+#include <algorithm>
+#include <string_view>
+#include <type_traits>
+#if __has_include(<version>)
+    #include <version>
+#endif
+#if defined(__cpp_lib_format) && defined(PRINT_USING_STD_FORMAT)
+    #include <format>
+    #include <memory>
+#endif
+#ifdef PRINT_USING_FMT
+    #include <fmt/format.h>
+#endif
+
+#ifdef __cpp_lib_is_constant_evaluated
+    #define PRINT_USING_PARSE_CONSTEXPR constexpr
+#else
+    #define PRINT_USING_PARSE_CONSTEXPR
+#endif
+
+// An argument for "{:pu(format)}". Integers and float use "E", double uses "D" (like N88-BASIC).
+struct print_using_arg {
+    double m_dbl = 0;
+    std::string_view m_str;
+    bool m_is_string = false;
+    bool m_is_double = true;
+
+    print_using_arg(double d) : m_dbl(d) { }
+    print_using_arg(float f) : m_dbl(f), m_is_double(false) { }
+    template <typename T, typename std::enable_if<std::is_integral<T>::value, int>::type = 0>
+    print_using_arg(T n) : m_dbl(double(n)), m_is_double(false) { }
+    print_using_arg(const char *s) : m_str(s), m_is_string(true) { }
+    print_using_arg(std::string_view s) : m_str(s), m_is_string(true) { }
+};
+
+// The common part of the formatters
+struct print_using_formatter_base {
+    PRINT_USING_ITEM m_item = {};
+
+    // Parses "pu(format)", "pu$(format)" or "pu\\(format)" and returns the position of the closing '}',
+    // or nullptr on error. In a constant evaluation (compile-time format string check) only the syntax
+    // is checked.
+    PRINT_USING_PARSE_CONSTEXPR const char *parse_spec(const char *begin, const char *end) {
+        if (end - begin < 5 || begin[0] != 'p' || begin[1] != 'u')
+            return nullptr;
+        PRINT_USING_DIALECT dialect = PRINT_USING_DIALECT_DEFAULT;
+        const char *format = begin + 2;
+        if (*format == '$') {
+            dialect = PRINT_USING_DIALECT_DOLLAR;
+            ++format;
+        } else if (*format == '\\') {
+            dialect = PRINT_USING_DIALECT_YEN;
+            ++format;
+        }
+        if (format >= end || *format != '(')
+            return nullptr;
+        const char *p = ++format;
+        while (p + 1 < end && !(p[0] == ')' && p[1] == '}'))
+            ++p;
+        if (p + 1 >= end)
+            return nullptr;
+#ifdef __cpp_lib_is_constant_evaluated
+        if (std::is_constant_evaluated())
+            return p + 1;
+#endif
+        if (!print_using_compile_item(&m_item, dialect, format, size_t(p - format)))
+            return nullptr;
+        return p + 1;
+    }
+
+    template <typename T_OUTPUT>
+    struct output {
+        T_OUTPUT m_out;
+        static void sink(void *context, const char *data, size_t len) {
+            auto self = static_cast<output *>(context);
+            self->m_out = std::copy_n(data, len, self->m_out);
+        }
+    };
+
+    // Formats arg into out. Returns false on a type mismatch.
+    template <typename T_OUTPUT>
+    bool format_arg(const print_using_arg& arg, T_OUTPUT& out) const {
+        if (arg.m_is_string == (m_item.numeric != 0))
+            return false;
+        output<T_OUTPUT> o = { out };
+        if (arg.m_is_string)
+            print_using_format_string(&m_item, arg.m_str.data(), arg.m_str.size(), &output<T_OUTPUT>::sink, &o);
+        else
+            print_using_format_number(&m_item, arg.m_dbl, arg.m_is_double, &output<T_OUTPUT>::sink, &o);
+        out = o.m_out;
+        return true;
+    }
+};
+
+#if defined(__cpp_lib_format) && defined(PRINT_USING_STD_FORMAT)
+namespace std {
+template <>
+struct formatter<print_using_arg, char> : print_using_formatter_base {
+    constexpr format_parse_context::iterator parse(format_parse_context& ctx) {
+        const char *begin = std::to_address(ctx.begin());
+        const char *p = parse_spec(begin, begin + (ctx.end() - ctx.begin()));
+        if (!p)
+            throw format_error("invalid PRINT USING format");
+        return ctx.begin() + (p - begin);
+    }
+    template <typename T_CONTEXT>
+    typename T_CONTEXT::iterator format(const print_using_arg& arg, T_CONTEXT& ctx) const {
+        auto out = ctx.out();
+        if (!format_arg(arg, out))
+            throw format_error("Type mismatch");
+        return out;
+    }
+};
+} // namespace std
+#endif
+
+#ifdef PRINT_USING_FMT
+namespace fmt {
+template <>
+struct formatter<print_using_arg, char> : print_using_formatter_base {
+    PRINT_USING_PARSE_CONSTEXPR format_parse_context::iterator parse(format_parse_context& ctx) {
+        const char *p = parse_spec(ctx.begin(), ctx.end());
+        if (!p)
+            throw format_error("invalid PRINT USING format");
+        return p;
+    }
+    template <typename T_CONTEXT>
+    auto format(const print_using_arg& arg, T_CONTEXT& ctx) const -> decltype(ctx.out()) {
+        auto out = ctx.out();
+        if (!format_arg(arg, out))
+            throw format_error("Type mismatch");
+        return out;
+    }
+};
+} // namespace fmt
+#endif
+#endif  // C++17 formatters